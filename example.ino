@@ -34,6 +34,8 @@ uint8_t calculate_CRC_8(const uint8_t* data, size_t length) {
     return crc;
 }
 
+void sendPacketWithEscape(uint8_t* packet, size_t length); // Definita più sotto
+
 void sendInitResponse(uint8_t responseCode) {
     uint8_t packet[6];  // Array per costruire il pacchetto con CRC
     packet[0] = INIT_CODE;
@@ -43,11 +45,10 @@ void sendInitResponse(uint8_t responseCode) {
     packet[4] = responseCode;
 
     // Calcola il CRC sui primi 5 byte del pacchetto
-    uint8_t crc = calculate_CRC_8(packet, 5);
+    packet[5] = calculate_CRC_8(packet, 5);
 
-    // Invia il pacchetto con il CRC e il codice di fine
-    Serial.write(packet, 5);   // Invia i 5 byte del pacchetto
-    Serial.write(crc);         // Invia il CRC calcolato
+    // Invia il pacchetto con il CRC (con escape, come gli altri) e il codice di fine
+    sendPacketWithEscape(packet, 6);
     Serial.write(END_CODE_INIT);    // Invia il codice di fine pacchetto
 }
 
@@ -62,16 +63,19 @@ void sendInitResponse(uint8_t responseCode) {
 #define ESCAPE_CHAR 0x7E
 
 // Massima dimensione del pacchetto
-#define MAX_PACKET_SIZE 10  // Adatta questa dimensione in base alle tue necessità
+#define MAX_PACKET_SIZE 120  // Adatta questa dimensione in base alle tue necessità (pacchetto aggregato con timestamp ed escape)
 
+// Il codice di fine viene inviato dal chiamante: qui si esegue l'escape di tutto tranne il codice iniziale (CRC compreso)
 void sendPacketWithEscape(uint8_t* packet, size_t length) {
     uint8_t escapedPacket[MAX_PACKET_SIZE];  // Pacchetto con spazio per byte aggiuntivi di escape
     size_t escapedLength = 0;  // Dimensione effettiva del pacchetto con escape
 
-    // Itera su tutti i byte del pacchetto tranne l'ultimo (il codice di fine)
-    for (size_t i = 0; i < length - 1; i++) {
-        if (packet[i] == 0xEE) {
-            // Se trovi 0xEE, inserisci prima l'ESCAPE_CHAR (0x7E)
+    // Il codice iniziale non va mai preceduto da escape
+    escapedPacket[escapedLength++] = packet[0];
+
+    for (size_t i = 1; i < length; i++) {
+        if (packet[i] == 0xEE || packet[i] == ESCAPE_CHAR) {
+            // Se trovi 0xEE o 0x7E, inserisci prima l'ESCAPE_CHAR (0x7E)
             escapedPacket[escapedLength++] = ESCAPE_CHAR;
         }
 
@@ -85,59 +89,210 @@ void sendPacketWithEscape(uint8_t* packet, size_t length) {
         }
     }
 
-    // Aggiungi l'ultimo byte del pacchetto (il codice di fine) senza modifiche
-    escapedPacket[escapedLength++] = packet[length - 1];                                           
-
     // Invia il pacchetto "escaped"
     Serial.write(escapedPacket, escapedLength);
 }
 
 
 
+// Timestamp di campionamento (micros(), big endian) prima del CRC, vedi protocol.md
+#define SEND_TIMESTAMPS true
+#define TIMESTAMP_FLAG 0x40
+
+// Scrive t (big endian) in 4 byte
+void putMicros(uint8_t* dest, uint32_t t) {
+    dest[0] = (t >> 24) & 0xFF;
+    dest[1] = (t >> 16) & 0xFF;
+    dest[2] = (t >> 8) & 0xFF;
+    dest[3] = t & 0xFF;
+}
+
 // Funzione per inviare i dati di un sensore
 void sendSensorData(uint8_t sensorCode, uint16_t sensorValue) {
-    uint8_t packet[9];  // Array per costruire il pacchetto
+    uint32_t sampleTime = micros();
+    uint8_t packet[12];  // Array per costruire il pacchetto
     packet[0] = SENSOR_CODE;
     packet[1] = 0x00;
-    packet[2] = 0x00;
+    packet[2] = SEND_TIMESTAMPS ? TIMESTAMP_FLAG : 0x00;
     packet[3] = sensorCode;
     packet[4] = 0x00;                
     packet[5] = (sensorValue >> 8) & 0xFF; // Byte alto del valore del sensore
     packet[6] = sensorValue & 0xFF;        // Byte basso del valore del sensore
 
-    // Calcola il CRC sui primi 7 byte del pacchetto
-    uint8_t crc = calculate_CRC_8(packet, 7);
-
-    // Aggiungi il CRC e il codice di fine
-    packet[7] = crc;
+    size_t length = 7;
+    if (SEND_TIMESTAMPS) {
+        putMicros(&packet[length], sampleTime);
+        length += 4;
+    }
 
+    // Calcola il CRC sui byte del pacchetto e lo aggiunge in coda
+    packet[length] = calculate_CRC_8(packet, length);
 
-    sendPacketWithEscape(packet, 8);
+    sendPacketWithEscape(packet, length + 1);
 
     // Invia il pacchetto tramite la seriale
     Serial.write(END_CODE_SENSOR);
 }
 
 
+// Comandi affidabili (vedi protocol.md)
+#define RELIABLE_FLAG 0x80
+#define ACK_COMMAND 0x7F
+#define ACK_OK 0x00
+#define ACK_CRC_FAILED 0x06
+#define TIME_SYNC 0x03
+#define TIME_SYNC_RESPONSE 0x7C
+#define RX_FRAME_SIZE 64
+
+// Pacchetto in ricezione (byte stuffing già rimosso)
+uint8_t rxFrame[RX_FRAME_SIZE];
+size_t rxLength = 0;
+bool rxEscape = false;
+uint32_t rxMicros = 0; // Arrivo dell'ultimo pacchetto (END ricevuto)
+
+// Invio aggregato: un solo pacchetto (un solo CRC) per più campioni, vedi protocol.md
+#define SENSOR_BATCHING true
+#define AGGREGATE_COMMAND 0x7D
+#define MAX_BATCH 8        // Campioni per pacchetto
+#define BATCH_INTERVAL 5   // ms di attesa massima di un campione in coda
+
+uint8_t batch[MAX_BATCH][4];
+uint32_t batchMicros[MAX_BATCH]; // Istante di campionamento di ogni campione
+size_t batchCount = 0;
+unsigned long batchStart = 0;
+
+// Invia i campioni in coda: AA addr 7D count (id tipo alto basso) * count [t0 (offset alto basso) * count] CRC EE
+// Con SEND_TIMESTAMPS il count ha il bit TIMESTAMP_FLAG: t0 = micros() del primo campione, offset in us da t0
+void flushSensorBatch() {
+    if (batchCount == 0) return;
+
+    uint8_t packet[4 + MAX_BATCH * 4 + 4 + MAX_BATCH * 2 + 1];
+    packet[0] = SENSOR_CODE;
+    packet[1] = address;
+    packet[2] = AGGREGATE_COMMAND;
+    packet[3] = SEND_TIMESTAMPS ? (batchCount | TIMESTAMP_FLAG) : batchCount;
+    for (size_t i = 0; i < batchCount; i++) memcpy(&packet[4 + i * 4], batch[i], 4);
+
+    size_t length = 4 + batchCount * 4;
+    if (SEND_TIMESTAMPS) {
+        putMicros(&packet[length], batchMicros[0]);
+        length += 4;
+        for (size_t i = 0; i < batchCount; i++) {
+            uint32_t offset = batchMicros[i] - batchMicros[0];
+            if (offset > 0xFFFF) offset = 0xFFFF; // BATCH_INTERVAL è molto più breve
+            packet[length++] = (offset >> 8) & 0xFF;
+            packet[length++] = offset & 0xFF;
+        }
+    }
+    packet[length] = calculate_CRC_8(packet, length);
+
+    sendPacketWithEscape(packet, length + 1);
+    Serial.write(END_CODE_SENSOR);
+    batchCount = 0;
+}
+
+// Accoda un campione, il pacchetto parte quando è pieno o dopo BATCH_INTERVAL
+void queueSensorSample(uint8_t sensorCode, uint8_t type, uint16_t sensorValue) {
+    if (batchCount == 0) batchStart = millis();
+    batchMicros[batchCount] = micros();
+    batch[batchCount][0] = sensorCode;
+    batch[batchCount][1] = type;
+    batch[batchCount][2] = (sensorValue >> 8) & 0xFF; // Byte alto del valore del sensore
+    batch[batchCount][3] = sensorValue & 0xFF;        // Byte basso del valore del sensore
+    batchCount++;
+    if (batchCount == MAX_BATCH) flushSensorBatch();
+}
+
+// Singolo pacchetto o coda, in base a SENSOR_BATCHING
+void sendSample(uint8_t sensorCode, uint16_t sensorValue) {
+    if (SENSOR_BATCHING) queueSensorSample(sensorCode, 0x00, sensorValue);
+    else sendSensorData(sensorCode, sensorValue);
+}
+
 // Funzione per gestire l'inizializzazione
-void handleInitPacket() {
-    if (Serial.available() >= 6) { // Assicurati che ci siano almeno 6 byte disponibili
-        uint8_t initCode = Serial.read();
-        if (initCode == INIT_CODE) {
-            uint8_t addr = Serial.read();
-            uint8_t ver = Serial.read();
-            uint8_t subVer = Serial.read();
-            uint8_t frequency = Serial.read();  // Frequenza non utilizzata in questa simulazione
-           uint8_t CRC = Serial.read();
-
-            // Logica per controllare la versione
-            if (ver < version || (ver == version && subVer < subVersion)) {
-                sendInitResponse(OLD_VERSION);
-            } else {
-                sendInitResponse(0x00);  // Risposta positiva
-                inited = true;
-            }
+void handleInitPacket(uint8_t* frame, size_t length) {
+    if (length < 6) return;
+    uint8_t ver = frame[2];
+    uint8_t subVer = frame[3];
+    // frame[4]: frequenza non utilizzata in questa simulazione
+
+    // Logica per controllare la versione
+    if (ver < version || (ver == version && subVer < subVersion)) {
+        sendInitResponse(OLD_VERSION);
+    } else {
+        sendInitResponse(0x00);  // Risposta positiva
+        inited = true;
+    }
+}
+
+// Conferma (o rifiuta) un comando con numero di sequenza
+void sendAck(uint8_t seq, uint8_t status) {
+    uint8_t packet[6];
+    packet[0] = COMM_CODE;
+    packet[1] = address;
+    packet[2] = ACK_COMMAND;
+    packet[3] = seq;
+    packet[4] = status;
+    packet[5] = calculate_CRC_8(packet, 5);
+
+    sendPacketWithEscape(packet, 6);
+    Serial.write(END_CODE_SENSOR);
+}
+
+// Risposta alla sincronizzazione: AA addr 7C id_basso id_alto t2 t3 CRC EE
+void sendTimeSync(uint8_t idLow, uint8_t idHigh) {
+    uint8_t packet[14];
+    packet[0] = COMM_CODE;
+    packet[1] = address;
+    packet[2] = TIME_SYNC_RESPONSE;
+    packet[3] = idLow;
+    packet[4] = idHigh;
+    putMicros(&packet[5], rxMicros); // t2: richiesta ricevuta
+    putMicros(&packet[9], micros()); // t3: risposta inviata, il più tardi possibile
+    packet[13] = calculate_CRC_8(packet, 13);
+
+    sendPacketWithEscape(packet, 14);
+    Serial.write(END_CODE_SENSOR);
+}
+
+// Funzione per gestire i comandi: AA addr comando [seq] argomenti CRC
+void handleCommPacket(uint8_t* frame, size_t length) {
+    if (length < 4) return;
+    bool crcOk = calculate_CRC_8(frame, length - 1) == frame[length - 1];
+
+    if (frame[2] == TIME_SYNC) {
+        if (crcOk && length >= 6) sendTimeSync(frame[3], frame[4]);
+        return;
+    }
+
+    if (frame[2] & RELIABLE_FLAG) {
+        // Un comando ritrasmesso viene applicato di nuovo: i comandi di configurazione sono idempotenti
+        // Qui andrebbe applicato il comando (frame[2] & ~RELIABLE_FLAG, argomenti da frame[4])
+        sendAck(frame[3], crcOk ? ACK_OK : ACK_CRC_FAILED);
+    }
+}
+
+// Ricostruisce i pacchetti in arrivo e li smista in base al codice iniziale
+void handleIncoming() {
+    while (Serial.available() > 0) {
+        uint8_t b = Serial.read();
+
+        if (!rxEscape && b == ESCAPE_CHAR) {
+            rxEscape = true;
+            continue;
         }
+
+        if (!rxEscape && b == END_CODE_SENSOR) {
+            rxMicros = micros();
+            if (rxLength > 0 && rxFrame[0] == INIT_CODE) handleInitPacket(rxFrame, rxLength);
+            if (rxLength > 0 && rxFrame[0] == COMM_CODE) handleCommPacket(rxFrame, rxLength);
+            rxLength = 0;
+            continue;
+        }
+
+        rxEscape = false;
+        if (rxLength < RX_FRAME_SIZE) rxFrame[rxLength++] = b;
+        else rxLength = 0; // Pacchetto troppo lungo, scartato
     }
 }
 
@@ -150,26 +305,31 @@ void sendHeartbeat() {
     uint8_t statusCode = random(0, 8);   // Status code può variare tra 0 e 7 (3 bit)
 
     // Crea il pacchetto di heartbeat
-    uint8_t packet[5];  // Array per costruire il pacchetto di heartbeat
+    uint8_t packet[9];  // Array per costruire il pacchetto di heartbeat
     packet[0] = HEARTBEAT_CODE;
     packet[1] = address;
 
     // Combina status e statusCode in un unico byte
+    // Il bit 6 segnala il timestamp in coda
     uint8_t combinedStatus = (status << 7) | (statusCode & 0x07); // Status in bit 7 e statusCode nei bit 0-2
+    if (SEND_TIMESTAMPS) combinedStatus |= TIMESTAMP_FLAG;
     packet[2] = combinedStatus; // Status e StatusCode
 
     // Inserisci 0xEE (END_CODE_HB) all'interno del pacchetto, per simulare il caso in cui
     // questo valore sia parte del messaggio, non solo come codice di fine.
     packet[3] = END_CODE_HB;
 
-    // Calcola il CRC sui primi 4 byte del pacchetto
-    uint8_t crc = calculate_CRC_8(packet, 4);
+    size_t length = 4;
+    if (SEND_TIMESTAMPS) {
+        putMicros(&packet[length], micros());
+        length += 4;
+    }
 
-    // Aggiungi il CRC alla fine del pacchetto
-    packet[4] = crc;
+    // Calcola il CRC e lo aggiunge alla fine del pacchetto
+    packet[length] = calculate_CRC_8(packet, length);
 
     // Invia il pacchetto dopo aver controllato gli escape
-    sendPacketWithEscape(packet, 5);
+    sendPacketWithEscape(packet, length + 1);
 
     // Invia il codice di fine pacchetto
     Serial.write(END_CODE_HB);
@@ -182,8 +342,8 @@ void setup() {
 }
 
 void loop() {
-    // Gestisci il pacchetto di inizializzazione
-    handleInitPacket();
+    // Gestisci i pacchetti in arrivo (inizializzazione e comandi)
+    handleIncoming();
 
     // Simula il pacchetto di heartbeat ogni 1 secondo
     static unsigned long lastHeartbeat = 0;
@@ -200,18 +360,20 @@ void loop() {
     if (millis() - lastSensor1 >= 20 && inited) {
         lastSensor1 = millis();
         uint16_t sensor1Value = random(0, 1024);  // Valore casuale per il sensore 1
-        sendSensorData(SENSOR1_CODE, sensor1Value);
+        sendSample(SENSOR1_CODE, sensor1Value);
     }
 
     if (millis() - lastSensor2 >= 10 && inited) {
         lastSensor2 = millis();
         uint16_t sensor2Value = random(0, 1024);  // Valore casuale per il sensore 2
-        sendSensorData(SENSOR2_CODE, sensor2Value);
+        sendSample(SENSOR2_CODE, sensor2Value);
     }
 
     if (millis() - lastSensor3 >= 5 && inited) {
         lastSensor3 = millis();
         uint16_t sensor3Value = random(0, 1024);  // Valore casuale per il sensore 3
-        sendSensorData(SENSOR3_CODE, sensor3Value);
+        sendSample(SENSOR3_CODE, sensor3Value);
     }
+
+    if (batchCount > 0 && millis() - batchStart >= BATCH_INTERVAL) flushSensorBatch();
 }
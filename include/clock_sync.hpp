@@ -0,0 +1,74 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+#define CLOCK_SYNC_SAMPLES 16     // Exchanges kept for the estimate
+#define CLOCK_SYNC_MIN_SPAN 1000000 // us of host time between exchanges before the drift is estimated
+#define CLOCK_SYNC_RTT_TOLERANCE 1.5 // Exchanges used for the drift: round trip within this factor of the best one
+
+// One request/response exchange: t1, t4 host (steady_clock, ns), t2, t3 device (micros(), unwrapped)
+typedef struct {
+    int64_t t1;
+    int64_t t2;
+    int64_t t3;
+    int64_t t4;
+} clock_exchange_t;
+
+/**
+ * NTP-style estimate of the Nucleo clock (32 bit micros()) against the host steady_clock
+ * offset from the exchange with the smallest round trip, drift from a linear fit of all exchanges
+ */
+class ClockSync {
+    public:
+        ClockSync();
+
+        void reset();
+
+        /**
+         * Add an exchange
+         * @param t1 Request sent (host)
+         * @param t2 Request received (device us)
+         * @param t3 Response sent (device us)
+         * @param t4 Response received (host)
+         */
+        void add_exchange(std::chrono::steady_clock::time_point t1, uint32_t t2, uint32_t t3, std::chrono::steady_clock::time_point t4);
+
+        bool is_synchronized() const { return m_count > 0; }
+
+        /**
+         * Device timestamp read from a frame: moves the wrap-around reference of to_host forward between exchanges
+         */
+        void observe(uint32_t device_us);
+
+        /**
+         * Device timestamp in host clock
+         * micros() wraps every ~71 minutes: the result is right within ~35 minutes of the last exchange or observed timestamp
+         * @return std::nullopt if no exchange was completed yet
+         */
+        std::optional<std::chrono::steady_clock::time_point> to_host(uint32_t device_us) const;
+
+        double get_offset_us() const { return m_offset_us; }       // Device - host at the best exchange
+        double get_drift_ppm() const { return (m_skew - 1.0) * 1e6; }
+        double get_round_trip_us() const { return m_round_trip_us; } // Of the best exchange
+
+    private:
+        std::array<clock_exchange_t, CLOCK_SYNC_SAMPLES> m_exchanges;
+        size_t m_count;
+        size_t m_next;
+        int64_t m_last_device_us; // Unwrapping reference of the 32 bit device clock (last exchange or observed timestamp)
+        double m_offset_us;
+        double m_skew;            // Device us per host us
+        double m_round_trip_us;
+        double m_host_reference_us;
+        double m_device_reference_us;
+
+        int64_t unwrap(uint32_t device_us) const;
+
+        void estimate();
+};
+
+#endif // CLOCK_SYNC_H
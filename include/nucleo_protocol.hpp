@@ -13,6 +13,10 @@
 
 #include "protocol_utils.hpp"
 #include "serial.hpp"
+#include "telemetry_bus.hpp"
+#include "realtime.hpp"
+#include "clock_sync.hpp"
+#include "stage_profiler.hpp"
 
 #define MAX_RETRY 5
 #define TIME_BETWEEN 10 // ms
@@ -21,8 +25,11 @@
 class Protocol {
     public:
         // Constructors & Deconstructor
-        Protocol(uint8_t address, uint8_t version, uint8_t sub_version, int baudrate, bool verbose = false);
-        Protocol(protocol_config_t protocol_config);
+        // resource: every internal container (and every returned packet) is allocated from it, must outlive Protocol
+        // Every read allocates and frees frames: a monotonic_buffer_resource (never reclaims) gets an internal
+        // unsynchronized_pool_resource on top, freed frames are recycled and every byte still comes from the arena
+        Protocol(uint8_t address, uint8_t version, uint8_t sub_version, int baudrate, bool verbose = false, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+        Protocol(protocol_config_t protocol_config, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
         ~Protocol();
 
         // Methods
@@ -31,6 +38,17 @@ class Protocol {
         bool connect();
 
         void disconnect();
+
+        /**
+         * Serial tuning (see serial_tuning_t), reconnects if already connected
+         */
+        bool set_serial_tuning(const serial_tuning_t &tuning);
+
+        /**
+         * Device tried before the /dev/ttyS* scan (e.g. /dev/ttyUSB0 or a pty), (re)connects right away
+         * @return True: connected (to this device or, if it cannot be opened, to a scanned one)
+         */
+        bool set_serial_device(const std::string &device);
         
         COMM_STATUS init(uint8_t interval, uint8_t max_retries = MAX_RETRY, uint8_t time_between_retries = TIME_BETWEEN);
 
@@ -38,14 +56,113 @@ class Protocol {
 
         packet_t get_packet(uint8_t start_byte, uint8_t end_byte = END_SEQ);
 
+        /**
+         * Lazy decoding: update_buffer only frames and stores the newest raw frame of each key,
+         * CRC check and payload extraction run when the key is read (get_packet or wait_for on it)
+         * Frames are still decoded on arrival while the telemetry bus is enabled
+         * The next older frame of a key in the batch is kept raw too, it is decoded only if the newest one is corrupt
+         */
+        void set_lazy_decode(bool lazy);
+
+        // Acknowledged (see enable_reliable_commands) or fire-and-forget
         bool set_sensor(sensor_config_t sensor);
 
+        /**
+         * Enable acknowledged configuration commands: set_sensor and send_reliable
+         * TX_DISCARD_PENDING serial tuning is switched to TX_APPEND
+         * @param window Commands in flight at the same time
+         * @param timeout Time before a selective retransmission
+         * @param max_retries Retransmissions before a command is given up
+         */
+        void enable_reliable_commands(uint8_t window = RELIABLE_WINDOW, std::chrono::milliseconds timeout = std::chrono::milliseconds(RELIABLE_TIMEOUT), uint8_t max_retries = RELIABLE_MAX_RETRY);
+
+        /**
+         * Queue a command the Nucleo must acknowledge, it leaves as soon as the window has room
+         * Retransmissions and acks are handled by update_buffer, wait_for and flush_reliable
+         * @return Sequence number, -1: serial not connected or reliable mode disabled
+         */
+        int send_reliable(uint8_t command, uint16_t *packet_array, size_t packet_array_length);
+
+        /**
+         * Wait until every reliable command is acknowledged
+         * @return OK: all applied, NUCLEO_TIMEOUT: deadline reached or commands given up, SERIAL_NOT_ESTABLISHED
+         */
+        COMM_STATUS flush_reliable(std::chrono::steady_clock::time_point deadline);
+
+        size_t pending_reliable() const { return m_pending.size(); }
+
         packet_t get_sensor(uint8_t ID);
 
         packet_t get_heartbeat();
+
+        /**
+         * Timeline of the last frame consumed (get_packet, get_sensor, get_heartbeat) for a key
+         * sample_time is set only for timestamped frames after a clock synchronisation
+         */
+        frame_timing_t get_timing(uint8_t key) const { return m_consumed_timing[key]; }
+
+        /**
+         * Synchronise with the Nucleo clock through request/response exchanges (blocking)
+         * @param exchanges Number of exchanges, the best one gives the offset
+         * @param timeout Maximum wait of each answer
+         * @return OK: at least one exchange completed, NUCLEO_TIMEOUT, SERIAL_NOT_ESTABLISHED
+         */
+        COMM_STATUS sync_clock(uint8_t exchanges = CLOCK_SYNC_EXCHANGES, std::chrono::milliseconds timeout = std::chrono::milliseconds(CLOCK_SYNC_TIMEOUT));
+
+        /**
+         * Send one exchange periodically from update_buffer/wait_for, needed to follow the drift. 0 -> disabled
+         * TX_DISCARD_PENDING serial tuning is switched to TX_APPEND
+         */
+        void set_clock_sync_interval(std::chrono::milliseconds interval);
+
+        const ClockSync &get_clock() const { return m_clock; }
         
         keys_t update_buffer();
 
+        /**
+         * Block until every key has a fresh (not yet consumed) frame, or until the deadline
+         * Bytes are decoded as soon as the serial is readable, no fixed sleep
+         * @param keys Keys to wait for (e.g. HB_SEQ and sensor IDs)
+         * @return Keys still missing at the deadline, empty: all arrived
+         */
+        keys_t wait_for(const keys_t &keys, std::chrono::steady_clock::time_point deadline);
+
+        keys_mask_t wait_for(keys_mask_t keys, std::chrono::steady_clock::time_point deadline);
+
+        /**
+         * Publish every valid frame, in arrival order, on a POSIX shared memory ring (see telemetry_bus.hpp)
+         * Older frames of a key overwritten in the packet buffer are published too
+         * @param name Shared memory name, readers attach with TelemetryReader
+         * @return True: publisher ready, False: error
+         */
+        bool enable_telemetry_bus(const std::string &name, uint32_t capacity = TELEMETRY_DEFAULT_CAPACITY);
+
+        void disable_telemetry_bus();
+
+        /**
+         * Real-time profile for the thread servicing the serial: call it from the thread running update_buffer/wait_for
+         * Also pre-faults the Protocol buffers. Missing privileges are reported and skipped
+         */
+        realtime_report_t set_realtime_profile(const realtime_config_t &config);
+
+        /**
+         * Snapshot of the link counters
+         * Rates are computed over the window since the previous stats() call, the periodic export keeps its own window
+         * Not thread safe: call it from the thread running update_buffer/wait_for
+         */
+        protocol_stats_t stats();
+
+        /**
+         * Write stats() in Prometheus text format
+         * @return True: file written, False: error
+         */
+        bool export_stats(const std::string &path);
+
+        /**
+         * Export stats periodically from update_buffer, an empty path disables the export
+         */
+        void set_stats_export(const std::string &path, std::chrono::milliseconds interval = std::chrono::seconds(1));
+
 
     private:
 
@@ -53,14 +170,74 @@ class Protocol {
         uint8_t m_address;
         uint8_t m_version;
         uint8_t m_sub_version;
-        std::unordered_map<uint8_t, packet_t> m_buffer;
+        std::optional<std::pmr::unsynchronized_pool_resource> m_pool; // Over a caller monotonic resource only
+        std::pmr::memory_resource *m_resource;
+        buffer_t m_buffer;
         bool m_verbose;
+        TelemetryPublisher m_telemetry;
+
+        // Link statistics
+        protocol_counters_t m_counters;
+        std::chrono::steady_clock::time_point m_start_time;
+        stats_window_t m_stats_window = {};  // stats()
+        stats_window_t m_export_window = {}; // Periodic export
+        std::string m_stats_path;
+        std::chrono::milliseconds m_stats_interval;
+        std::chrono::steady_clock::time_point m_last_stats_export;
+
+        // Reliable commands
+        bool m_reliable;
+        uint8_t m_window;
+        std::chrono::milliseconds m_reliable_timeout;
+        uint8_t m_max_retries;
+        uint8_t m_next_seq;
+        size_t m_failed_commands; // Given up since the last flush_reliable
+        std::pmr::vector<pending_command_t> m_pending; // Sequence order
+
+        // Clock synchronisation and frame timing
+        ClockSync m_clock;
+        uint16_t m_sync_id;
+        bool m_sync_pending;
+        std::chrono::steady_clock::time_point m_sync_sent_at;
+        std::chrono::milliseconds m_sync_interval;
+        std::chrono::steady_clock::time_point m_arrival_time; // Of the batch being decoded
+        std::array<frame_timing_t, 256> m_timing;             // Frames in m_buffer
+        std::array<frame_timing_t, 256> m_consumed_timing;
+
+        bool m_lazy_decode;
+        buffer_t m_fallback; // Lazy: second newest raw frame of a key in the last batch
+
+        std::pmr::memory_resource *pooled_resource(std::pmr::memory_resource *resource);
+
+        protocol_stats_t snapshot(stats_window_t &window);
 
-        void decode_packet(std::vector<uint8_t> &packet, std::vector<uint8_t> &keys);
+        void decode_packet(std::pmr::vector<uint8_t> &packet, keys_t &keys);
 
-        bool handle_buffer_reconstruction(std::vector<uint8_t> &packet, std::vector<uint8_t> &keys);
+        packet_t extract_payload(const std::pmr::vector<uint8_t> &packet, uint8_t key);
+
+        packet_t decode_lazy(uint8_t key, const std::pmr::vector<uint8_t> &packet);
+
+        void publish_frame(const std::pmr::vector<uint8_t> &packet);
+
+        bool handle_buffer_reconstruction(std::pmr::vector<uint8_t> &packet, keys_t &keys);
         
-        void handle_packet_stream(std::vector<std::vector<uint8_t>> &packets);
+        void handle_packet_stream(std::pmr::vector<std::pmr::vector<uint8_t>> &packets);
+
+        void read_serial();
+
+        void encode_comm_packet(std::pmr::vector<uint8_t> &packet, uint16_t *packet_array, size_t packet_array_length);
+
+        void handle_ack(const std::pmr::vector<uint8_t> &packet);
+
+        void handle_aggregate(const std::pmr::vector<uint8_t> &packet, keys_t &keys);
+
+        void handle_time_sync(const std::pmr::vector<uint8_t> &packet);
+
+        bool request_time_sync();
+
+        void transmit_pending(pending_command_t &command);
+
+        void service_reliable();
 };
 
 
@@ -2,6 +2,9 @@
 #define PROTOCOL_UTILS_H
 
 
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <chrono>
 #include <iostream>
 #include <cstdint>
@@ -11,6 +14,7 @@
 #include <optional>
 #include <unordered_map>
 #include <vector>
+#include <memory_resource>
 #include <algorithm> 
 
 
@@ -24,13 +28,35 @@
 #define INIT_SEQ 0xFF
 #define RESERVED_BUFFER_KEY 0xDE
 
+// Reliable commands (see protocol.md)
+#define RELIABLE_FLAG 0x80  // OR-ed to the command: a sequence byte follows
+#define ACK_COMMAND 0x7F    // Nucleo -> Pi: AA addr 7F seq status CRC EE
+#define ACK_OK 0x00         // Any other status is a NACK
+#define RELIABLE_WINDOW 16  // Commands in flight (max 128: half of the sequence space)
+#define RELIABLE_TIMEOUT 20 // ms before a selective retransmission
+#define RELIABLE_MAX_RETRY 5
+
+// Aggregated telemetry (see protocol.md): AA addr 7D count (id type value_high value_low) * count CRC EE
+// TIMESTAMP_FLAG in the count byte: the samples are followed by t0 (micros() of the first one) and an offset per sample
+#define AGGREGATE_COMMAND 0x7D
+#define AGGREGATE_TUPLE_SIZE 4
+#define AGGREGATE_OFFSET_SIZE 2 // us after t0, big endian
+
+// Device timestamps and clock synchronisation (see protocol.md)
+#define TIMESTAMP_FLAG 0x40      // In the sensor command byte / heartbeat status byte / aggregate count byte: micros() before the CRC
+#define TIMESTAMP_SIZE 4
+#define TIME_SYNC_RESPONSE 0x7C  // Nucleo -> Pi: AA addr 7C id_low id_high t2 t3 CRC EE
+#define CLOCK_SYNC_EXCHANGES 8
+#define CLOCK_SYNC_TIMEOUT 50    // ms
+
 static const uint8_t start_bytes[NUM_SEQ] = { INIT_SEQ, COMM_SEQ, HB_SEQ, SENS_SEQ };
 static const uint8_t bytes_to_escape[NUM_SEQ + 2] = { INIT_SEQ, COMM_SEQ, HB_SEQ, SENS_SEQ, END_SEQ, ESCAPE_CHAR };
 
 enum COMM_TYPE {
     MOTOR,
     ARM,
-    SENSOR
+    SENSOR,
+    TIME_SYNC
 };
 
 enum COMM_STATUS {
@@ -42,7 +68,8 @@ enum COMM_STATUS {
     NUCLEO_OLD_VERSION,
     NUCLEO_TIMEOUT,
     NUCLEO_INVALID_ANSWER,
-    CRC_FAILED
+    CRC_FAILED,
+    FRAME_NOT_DECODED   // Internal (lazy decoding): raw frame in the buffer, never returned by get_packet
 };
 
 enum HB_OK_STATUS {
@@ -64,9 +91,30 @@ enum SENSOR_TYPE {
     DEPTH
 };
 
-typedef std::pair<COMM_STATUS, std::optional<std::vector<uint8_t>>> packet_t;
+// Containers are std::pmr so that Protocol and Serial can draw them from a caller supplied resource
+typedef std::pair<COMM_STATUS, std::optional<std::pmr::vector<uint8_t>>> packet_t;
+
+typedef std::pmr::vector<uint8_t> keys_t;
+
+typedef std::pmr::unordered_map<uint8_t, packet_t> buffer_t;
 
-typedef std::vector<uint8_t> keys_t;
+typedef std::bitset<256> keys_mask_t;
+
+// Timeline of a frame, all in host clock
+typedef struct {
+    std::optional<uint32_t> device_us;                               // Raw device timestamp, if the frame carried one
+    std::optional<std::chrono::steady_clock::time_point> sample_time; // Device timestamp converted (needs a clock sync)
+    std::chrono::steady_clock::time_point arrival_time;              // Bytes read from the serial
+    std::chrono::steady_clock::time_point consume_time;              // get_packet
+} frame_timing_t;
+
+// Reliable command waiting for its ack
+typedef struct {
+    uint8_t seq;
+    std::pmr::vector<uint8_t> frame; // Stuffed and terminated, ready to be written
+    std::chrono::steady_clock::time_point sent_at;
+    uint8_t transmissions;           // 0 -> still queued outside the window
+} pending_command_t;
 
 typedef struct {
     uint8_t id;
@@ -75,6 +123,59 @@ typedef struct {
     SENSOR_TYPE type;
 } sensor_config_t;
 
+// Protocol counters, updated with relaxed atomics (read them through Protocol::stats(), see its thread rule)
+typedef struct {
+    std::atomic<uint64_t> crc_failures{0};
+    std::atomic<uint64_t> reassembly_successes{0};
+    std::atomic<uint64_t> reassembly_failures{0}; // Fragments erased without a match
+    std::atomic<uint64_t> frames_sent{0};         // INIT and COMM frames, retransmissions excluded
+    std::atomic<uint64_t> escape_bytes_sent{0};
+    std::atomic<uint64_t> acks{0};
+    std::atomic<uint64_t> nacks{0};
+    std::atomic<uint64_t> retransmissions{0};
+    std::atomic<uint64_t> command_failures{0};    // Reliable commands given up after RELIABLE_MAX_RETRY
+    std::atomic<uint64_t> aggregated_frames{0};
+    std::atomic<uint64_t> key_frames[256] = {};   // Frames (or aggregated samples) received per key, overwritten ones included: single frames before the CRC check
+    std::atomic<uint64_t> key_bytes[256] = {};
+} protocol_counters_t;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t bytes;
+    double frames_per_second; // Over the window since the previous snapshot
+    double bytes_per_second;
+} key_stats_t;
+
+// Counters at the start of a rate window
+typedef struct {
+    std::chrono::steady_clock::time_point time;
+    std::array<uint64_t, 256> key_frames;
+    std::array<uint64_t, 256> key_bytes;
+} stats_window_t;
+
+// Snapshot returned by Protocol::stats()
+typedef struct {
+    double uptime_s;
+    double window_s;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t frames_received;
+    uint64_t frames_sent;
+    uint64_t escape_bytes_received;
+    uint64_t escape_bytes_sent;
+    uint64_t crc_failures;
+    uint64_t reassembly_successes;
+    uint64_t reassembly_failures;
+    uint64_t aggregated_frames;
+    uint64_t acks;
+    uint64_t nacks;
+    uint64_t retransmissions;
+    uint64_t command_failures;
+    uint64_t max_packets_reached;
+    uint64_t oversize_frames;
+    std::array<key_stats_t, 256> keys;
+} protocol_stats_t;
+
 typedef struct {
     uint8_t address; 
     uint8_t version; 
@@ -84,18 +185,27 @@ typedef struct {
 } protocol_config_t;
 
 
-uint8_t calculate_CRC_8(const std::vector<uint8_t>& data);
+uint8_t calculate_CRC_8(const uint8_t *data, size_t length);
 
-COMM_STATUS verify_response_CRC_8(const std::vector<uint8_t>& res);
+uint8_t calculate_CRC_8(const std::pmr::vector<uint8_t>& data);
 
-void add_escape_char(std::vector<uint8_t>& vec);
+COMM_STATUS verify_response_CRC_8(const std::pmr::vector<uint8_t>& res);
+
+void add_escape_char(std::pmr::vector<uint8_t>& vec);
 
 void remove_escape_char(std::vector<uint8_t>& input);
 
-keys_t get_keys(std::unordered_map<uint8_t, packet_t> buffer);
+// Keys are allocated from the same resource of the buffer
+keys_t get_keys(const buffer_t &buffer);
+
+bool is_valid_packet(const std::pmr::vector<uint8_t> &packet);
 
-bool is_valid_packet(std::vector<uint8_t> packet);
+void remove_reserved_key(bool verbose, const char *content, buffer_t &buffer);
 
-void remove_reserved_key(bool verbose, std::string content, std::unordered_map<uint8_t, packet_t> &buffer);
+/**
+ * Write a stats snapshot in Prometheus text format (atomically: temporary file + rename)
+ * @return True: file written, False: error
+ */
+bool write_prometheus_stats(const protocol_stats_t &stats, const std::string &path);
 
 #endif // PROTOCOL_UTILS_H
\ No newline at end of file
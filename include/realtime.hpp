@@ -0,0 +1,53 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <chrono>
+#include <cstddef>
+
+#define RT_DEFAULT_PRIORITY 50
+#define RT_PREFAULT_STACK (512 * 1024) // Bytes, get_byte_vectors alone keeps ~25 KB on the stack
+
+// Real-time execution profile for the thread servicing the UART (the one calling update_buffer/wait_for)
+typedef struct {
+    int cpu = -1;                           // Core to pin the thread to, -1 -> no pinning
+    bool fifo = false;                      // SCHED_FIFO instead of SCHED_OTHER
+    int priority = RT_DEFAULT_PRIORITY;     // SCHED_FIFO priority (1 - 99)
+    bool lock_memory = false;               // mlockall(MCL_CURRENT | MCL_FUTURE)
+    size_t prefault_stack = RT_PREFAULT_STACK; // Stack bytes touched in advance, 0 -> none
+} realtime_config_t;
+
+// What was actually applied: missing privileges never abort, the step is just skipped
+typedef struct {
+    bool pinned;
+    bool fifo;
+    bool memory_locked;
+    bool prefaulted;
+} realtime_report_t;
+
+// Wake-up latency distribution (microseconds)
+typedef struct {
+    size_t samples;
+    double min;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    double max;
+} latency_stats_t;
+
+/**
+ * Apply the profile to the calling thread
+ * Steps that fail (e.g. no CAP_SYS_NICE / CAP_IPC_LOCK) are reported on stderr and skipped
+ */
+realtime_report_t apply_realtime_profile(const realtime_config_t &config);
+
+/**
+ * Measure how late the calling thread wakes up from an absolute sleep
+ * @param period Sleep period
+ * @param samples Number of wake-ups
+ */
+latency_stats_t measure_wakeup_latency(std::chrono::microseconds period, size_t samples);
+
+void print_latency_stats(const char *label, const latency_stats_t &stats);
+
+#endif // REALTIME_H
@@ -2,11 +2,54 @@
 #define SERIAL_H_
 
 #include <iostream>
+#include <atomic>
+#include <chrono>
 #include <vector>
+#include <memory_resource>
 #include <unistd.h>
 #include <cstring>
 #include <unordered_map>
 #include <filesystem>
+#include <array>
+
+#define SERIAL_READ_CHUNK 1024 // Bytes per read(), frames left over are framed by the next get_byte_vectors
+
+// Link counters, updated with relaxed atomics (readable from any thread)
+typedef struct {
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> frames_received{0};     // Terminal bytes seen
+    std::atomic<uint64_t> escape_bytes_received{0};
+    std::atomic<uint64_t> max_packets_reached{0};  // Reads stopped by MAX_PACKETS, newer frames left for the next read
+    std::atomic<uint64_t> oversize_frames{0};      // Frames cut by MAX_PACKET_SIZE
+} serial_counters_t;
+
+
+// What happens to bytes already queued in the kernel
+enum SERIAL_RX_STRATEGY {
+    RX_FLUSH_ON_OPEN,   // Discard stale input when the port is opened
+    RX_KEEP_ON_OPEN
+};
+
+enum SERIAL_TX_STRATEGY {
+    TX_DISCARD_PENDING, // tcflush(TCOFLUSH) before every write: unsent bytes are dropped
+    TX_APPEND,          // Queue after pending bytes
+    TX_DRAIN            // tcdrain after every write: returns when the bytes left the UART
+};
+
+// Defaults reproduce the wiringPi behaviour, see low_latency_serial_tuning() for the fast profile
+typedef struct {
+    bool low_latency = false;       // ASYNC_LOW_LATENCY through TIOCSSERIAL (e.g. FTDI latency timer 16 ms -> 1 ms)
+    bool custom_baudrate = false;   // termios2/BOTHER for rates without a Bxxxx constant (false: refused, as wiringPi)
+    uint8_t vmin = 0;               // VMIN/VTIME: with VTIME = 0 poll() (wait_for) wakes up only after VMIN bytes
+    uint8_t vtime = 100;            // Deciseconds
+    int open_settle_us = 10000;     // Sleep after open
+    SERIAL_RX_STRATEGY rx_strategy = RX_FLUSH_ON_OPEN;
+    SERIAL_TX_STRATEGY tx_strategy = TX_DISCARD_PENDING;
+} serial_tuning_t;
+
+serial_tuning_t low_latency_serial_tuning();
+
 
 class Serial {
     public:
@@ -14,25 +57,45 @@ class Serial {
         
         std::string get_device() const { return m_device; }
         int get_fd() const { return m_fd; }
+        const serial_counters_t &get_counters() const { return m_counters; }
         void set_verbose(bool val);
         void set_baudrate(int baudrate);
 
+        /**
+        * Tuning applied by the next connect_serial (unsupported settings fall back with a warning)
+        */
+        void set_tuning(const serial_tuning_t &tuning);
+        const serial_tuning_t &get_tuning() const { return m_tuning; }
+
+        /**
+        * Resource used for the containers returned by get_byte_vectors
+        * @param resource Must outlive the Serial instance and reclaim freed blocks (pool, not monotonic)
+        */
+        void set_memory_resource(std::pmr::memory_resource *resource);
+
         bool check_connection();
         
         void disconnect_serial();
         
         /**
-        * Connect serial communication, device is assigned automatically
+        * Connect serial communication, the device set with set_device is tried first, then /dev/ttyS*
         * @return True: successful connection, False: error in connection
         */
         int connect_serial();
         
         /**
-        * Get the amount of incoming bytes from serial communication  
+        * Get the amount of incoming bytes from serial communication (kernel queue and bytes read but not framed yet)
         * 
         */
         int get_available_data();
 
+        /**
+        * Block until incoming bytes are available (poll on the file descriptor)
+        * @param timeout Maximum wait
+        * @return 1: data available, 0: timeout or signal, -1: error or hang up
+        */
+        int wait_for_data(std::chrono::nanoseconds timeout);
+
 
         void set_device(std::string serial_interface);
         std::string get_device();
@@ -45,9 +108,9 @@ class Serial {
          * @param terminal Final byte
          * @return Byte vector
          */
-        std::vector<std::vector<uint8_t>> get_byte_vectors(uint8_t terminal, uint8_t escape);
+        std::pmr::vector<std::pmr::vector<uint8_t>> get_byte_vectors(uint8_t terminal, uint8_t escape);
 
-        ssize_t send_byte_array(std::vector<uint8_t> bytes);
+        ssize_t send_byte_array(const std::pmr::vector<uint8_t> &bytes);
 
     private:
         int m_fd; // File Descriptor
@@ -55,6 +118,12 @@ class Serial {
         std::string m_device;
         bool m_verbose;
         int m_baudrate;
+        std::pmr::memory_resource *m_resource;
+        serial_counters_t m_counters;
+        serial_tuning_t m_tuning;
+        std::array<uint8_t, SERIAL_READ_CHUNK> m_rx_chunk; // Last read(), [m_rx_head, m_rx_tail) not framed yet
+        size_t m_rx_head;
+        size_t m_rx_tail;
 };
 
 
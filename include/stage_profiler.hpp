@@ -0,0 +1,81 @@
+#ifndef STAGE_PROFILER_H
+#define STAGE_PROFILER_H
+
+#include <array>
+#include <cstdint>
+
+#define STAGE_PROFILER_ENV "CHIMPANZEE_PROFILE" // Set (any value) -> Protocol enables the profiler, summary on exit
+#define STAGE_PROFILER_CALIBRATION 1000         // Empty probes measured by enable_stage_profiler, per round
+
+// Hot stages of the serial path, CRC is also counted inside DECODE and ENCODE (inclusive, nested probe cost removed)
+enum PROFILER_STAGE {
+    STAGE_READ,     // read() of a chunk from the UART
+    STAGE_FRAMING,  // Terminal search and byte unstuffing
+    STAGE_CRC,
+    STAGE_DECODE,   // Decode and store of a batch in the packet buffer
+    STAGE_ENCODE,   // Arguments, CRC and byte stuffing of an outgoing frame
+    STAGE_WRITE,    // write() (and tcflush/tcdrain of the TX strategy)
+    STAGE_COUNT
+};
+
+// Totals of one stage, cycles/instructions/cache_misses stay 0 without hardware counters
+// The calibrated cost of the probes themselves (own and nested ones) is already subtracted
+typedef struct {
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+} stage_stats_t;
+
+extern bool stage_profiler_active; // Checked by every probe, probes cost a branch when disabled
+
+/**
+ * Start profiling the calling thread (the one running update_buffer/wait_for)
+ * Hardware counters through perf_event_open, read in user space (rdpmc) where the kernel allows it,
+ * with a read() of the group otherwise; steady_clock only when they are not available
+ * (e.g. perf_event_paranoid, no PMU in a VM). The probe cost is calibrated here
+ * @param print_on_exit Print the summary at process exit
+ * @return True: hardware counters, False: time only
+ */
+bool enable_stage_profiler(bool print_on_exit = true);
+
+void disable_stage_profiler();
+
+void reset_stage_profiler();
+
+std::array<stage_stats_t, STAGE_COUNT> get_stage_stats();
+
+void print_stage_stats();
+
+// Scoped probe, see PROFILE_STAGE
+class StageProbe {
+    public:
+        explicit StageProbe(PROFILER_STAGE stage) : m_active(stage_profiler_active) {
+            if (m_active) start(stage);
+        }
+
+        ~StageProbe() {
+            if (m_active) stop();
+        }
+
+        StageProbe(const StageProbe &) = delete;
+        StageProbe &operator=(const StageProbe &) = delete;
+
+    private:
+        bool m_active;
+        PROFILER_STAGE m_stage;
+        StageProbe *m_parent; // Enclosing probe, its totals include this one
+        uint64_t m_nested;    // Probes run inside this one
+        uint64_t m_start_ns;
+        uint64_t m_start_counters[3];
+
+        void start(PROFILER_STAGE stage);
+        void stop();
+};
+
+#define PROFILE_STAGE_CONCAT_(a, b) a##b
+#define PROFILE_STAGE_NAME_(line) PROFILE_STAGE_CONCAT_(stage_probe_, line)
+#define PROFILE_STAGE(stage) StageProbe PROFILE_STAGE_NAME_(__LINE__)(stage)
+
+#endif // STAGE_PROFILER_H
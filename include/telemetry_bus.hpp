@@ -0,0 +1,132 @@
+#ifndef TELEMETRY_BUS_H
+#define TELEMETRY_BUS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#define TELEMETRY_MAGIC 0x43484D50 // "CHMP"
+#define TELEMETRY_LAYOUT_VERSION 2
+#define TELEMETRY_MAX_PAYLOAD 256
+#define TELEMETRY_NUM_KEYS 256
+#define TELEMETRY_DEFAULT_CAPACITY 1024 // Frames in the ring, rounded up to a power of two
+#define TELEMETRY_READ_SPINS 4096        // Attempts on a locked slot before a read gives up (publisher died inside)
+
+// Shared memory layout (single writer, many readers):
+// [ header | ring slots (capacity) | latest-value slots (one per key) ]
+// Every slot is guarded by a seqlock, readers never take locks nor make syscalls per sample
+
+typedef struct {
+    uint8_t key;
+    uint8_t address;
+    uint16_t length;
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC, comparable between processes on the same host
+    uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+} telemetry_frame_t;
+
+typedef struct {
+    std::atomic<uint32_t> lock; // Odd while the publisher is writing the slot
+    uint32_t sequence;          // Sequence number of the stored frame + 1 (0 -> never written)
+    telemetry_frame_t frame;
+} telemetry_slot_t;
+
+typedef struct {
+    std::atomic<uint32_t> magic; // Written last, readers wait for it
+    uint32_t version;
+    uint32_t capacity;
+    std::atomic<uint32_t> write_sequence; // Number of frames published so far
+    uint64_t generation;                  // Unique per TelemetryPublisher::open, a restart changes it
+    int32_t publisher_pid;
+    std::atomic<uint32_t> closed;         // Set by TelemetryPublisher::close
+} telemetry_header_t;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Telemetry bus needs lock-free 32 bit atomics");
+
+
+class TelemetryPublisher {
+    public:
+        TelemetryPublisher();
+        ~TelemetryPublisher();
+
+        /**
+         * Create (or replace) the shared memory segment
+         * @param name POSIX shared memory name, "/" is prepended if missing
+         * @param capacity Number of frames kept in the ring
+         * @return True: segment ready, False: error
+         */
+        bool open(const std::string &name, uint32_t capacity = TELEMETRY_DEFAULT_CAPACITY);
+
+        void close();
+
+        bool is_open() const { return m_header != nullptr; }
+
+        /**
+         * Publish a decoded frame in the ring and in the latest-value slot of its key
+         * Payloads longer than TELEMETRY_MAX_PAYLOAD are truncated
+         */
+        void publish(uint8_t key, uint8_t address, const uint8_t *payload, size_t length);
+
+    private:
+        std::string m_name;
+        void *m_memory;
+        size_t m_size;
+        telemetry_header_t *m_header;
+        telemetry_slot_t *m_ring;
+        telemetry_slot_t *m_latest;
+};
+
+
+class TelemetryReader {
+    public:
+        TelemetryReader();
+        ~TelemetryReader();
+
+        /**
+         * Attach to a segment created by a TelemetryPublisher
+         * Reading starts from the next published frame
+         * @return True: attached, False: segment missing or incompatible
+         */
+        bool open(const std::string &name);
+
+        void close();
+
+        bool is_open() const { return m_header != nullptr; }
+
+        /**
+         * Get the next frame of the ring
+         * If the publisher lapped this reader, skipped frames are added to the lost counter
+         * @return True: frame copied, False: no new frame (or slot still locked after TELEMETRY_READ_SPINS)
+         */
+        bool read_next(telemetry_frame_t &frame);
+
+        /**
+         * Get the most recent frame of a key
+         * @return True: frame copied, False: key never published
+         */
+        bool read_latest(uint8_t key, telemetry_frame_t &frame) const;
+
+        uint64_t get_lost() const { return m_lost; }
+
+        /**
+         * The attached segment is not fed anymore: publisher closed, dead or restarted (new generation)
+         * Costs a few syscalls, check it when read_next keeps returning false, then open() again
+         */
+        bool is_stale() const;
+
+        uint64_t get_generation() const { return m_generation; }
+
+    private:
+        std::string m_name;
+        uint64_t m_generation;
+        const void *m_memory;
+        size_t m_size;
+        const telemetry_header_t *m_header;
+        const telemetry_slot_t *m_ring;
+        const telemetry_slot_t *m_latest;
+        uint32_t m_next;
+        uint64_t m_lost;
+};
+
+
+#endif // TELEMETRY_BUS_H
@@ -0,0 +1,100 @@
+#include "clock_sync.hpp"
+
+// Utils -> Private
+
+static int64_t to_ns(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+ClockSync::ClockSync() {
+    reset();
+}
+
+void ClockSync::reset() {
+    m_count = 0;
+    m_next = 0;
+    m_last_device_us = 0;
+    m_offset_us = 0;
+    m_skew = 1.0;
+    m_round_trip_us = 0;
+    m_host_reference_us = 0;
+    m_device_reference_us = 0;
+}
+
+// micros() wraps every ~71 minutes: place the value in the 2^31 us around the last one seen
+int64_t ClockSync::unwrap(uint32_t device_us) const {
+    if (m_count == 0) return device_us;
+    int32_t delta = static_cast<int32_t>(device_us - static_cast<uint32_t>(m_last_device_us));
+    return m_last_device_us + delta;
+}
+
+void ClockSync::add_exchange(std::chrono::steady_clock::time_point t1, uint32_t t2, uint32_t t3, std::chrono::steady_clock::time_point t4) {
+    clock_exchange_t exchange;
+    exchange.t1 = to_ns(t1);
+    exchange.t2 = unwrap(t2);
+    exchange.t3 = exchange.t2 + static_cast<int32_t>(t3 - t2);
+    exchange.t4 = to_ns(t4);
+    m_last_device_us = exchange.t3;
+
+    m_exchanges[m_next] = exchange;
+    m_next = (m_next + 1) % CLOCK_SYNC_SAMPLES;
+    if (m_count < CLOCK_SYNC_SAMPLES) m_count++;
+
+    estimate();
+}
+
+void ClockSync::observe(uint32_t device_us) {
+    if (m_count > 0) m_last_device_us = unwrap(device_us);
+}
+
+void ClockSync::estimate() {
+    // Best exchange: smallest round trip, the least queuing delay on the serial
+    const clock_exchange_t *best = &m_exchanges[0];
+    double best_round_trip = 0;
+    for (size_t i = 0; i < m_count; i++) {
+        const clock_exchange_t &e = m_exchanges[i];
+        double round_trip = (e.t4 - e.t1) / 1000.0 - (e.t3 - e.t2);
+        if (i == 0 || round_trip < best_round_trip) {
+            best = &e;
+            best_round_trip = round_trip;
+        }
+    }
+
+    // Midpoints: offset = ((t2 - t1) + (t3 - t4)) / 2
+    m_host_reference_us = (best->t1 + best->t4) / 2000.0;
+    m_device_reference_us = (best->t2 + best->t3) / 2.0;
+    m_offset_us = m_device_reference_us - m_host_reference_us;
+    m_round_trip_us = best_round_trip;
+
+    // Drift: least squares of device midpoint against host midpoint (relative to the best one),
+    // only exchanges with a round trip close to the best one: a queued one shifts its midpoint
+    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+    double min_x = 0, max_x = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < m_count; i++) {
+        const clock_exchange_t &e = m_exchanges[i];
+        double round_trip = (e.t4 - e.t1) / 1000.0 - (e.t3 - e.t2);
+        if (round_trip > CLOCK_SYNC_RTT_TOLERANCE * best_round_trip) continue;
+
+        double x = (e.t1 + e.t4) / 2000.0 - m_host_reference_us;
+        double y = (e.t2 + e.t3) / 2.0 - m_device_reference_us;
+        sum_x += x;
+        sum_y += y;
+        sum_xx += x * x;
+        sum_xy += x * y;
+        if (used == 0 || x < min_x) min_x = x;
+        if (used == 0 || x > max_x) max_x = x;
+        used++;
+    }
+
+    double denominator = used * sum_xx - sum_x * sum_x;
+    if (used < 2 || max_x - min_x < CLOCK_SYNC_MIN_SPAN || denominator <= 0) m_skew = 1.0;
+    else m_skew = (used * sum_xy - sum_x * sum_y) / denominator;
+}
+
+std::optional<std::chrono::steady_clock::time_point> ClockSync::to_host(uint32_t device_us) const {
+    if (m_count == 0) return std::nullopt;
+
+    double host_us = m_host_reference_us + (unwrap(device_us) - m_device_reference_us) / m_skew;
+    return std::chrono::steady_clock::time_point(std::chrono::nanoseconds(static_cast<int64_t>(host_us * 1000.0)));
+}
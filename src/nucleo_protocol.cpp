@@ -1,92 +1,255 @@
 #include "nucleo_protocol.hpp"
 
+#include <cstdlib>
+
+// Monotonic arenas never reclaim: the per-read frames are recycled by a pool whose chunks come from the arena
+std::pmr::memory_resource *Protocol::pooled_resource(std::pmr::memory_resource *resource) {
+    if (dynamic_cast<std::pmr::monotonic_buffer_resource *>(resource) == nullptr) return resource;
+    m_pool.emplace(resource);
+    return &*m_pool;
+}
+
 // Constructor
 
-Protocol::Protocol(uint8_t version, uint8_t sub_version, uint8_t address, int baudrate, bool verbose) {
+Protocol::Protocol(uint8_t version, uint8_t sub_version, uint8_t address, int baudrate, bool verbose, std::pmr::memory_resource *resource) : m_resource(pooled_resource(resource)), m_buffer(m_resource), m_pending(m_resource), m_fallback(m_resource) {
     m_version = version;
     m_sub_version = sub_version;
     m_address = address;
     m_verbose = verbose;
-    m_buffer = {};
-
+    m_start_time = m_stats_window.time = m_export_window.time = m_last_stats_export = std::chrono::steady_clock::now();
+    m_stats_interval = std::chrono::seconds(1);
+    m_reliable = false;
+    m_window = RELIABLE_WINDOW;
+    m_reliable_timeout = std::chrono::milliseconds(RELIABLE_TIMEOUT);
+    m_max_retries = RELIABLE_MAX_RETRY;
+    m_next_seq = 0;
+    m_failed_commands = 0;
+    m_sync_id = 0;
+    m_sync_pending = false;
+    m_sync_interval = std::chrono::milliseconds(0);
+    m_lazy_decode = false;
+
+    if (std::getenv(STAGE_PROFILER_ENV) && !stage_profiler_active) enable_stage_profiler();
+
+    m_serial.set_memory_resource(m_resource);
     m_serial.set_baudrate(baudrate);
     m_serial.set_verbose(verbose);
     m_serial.connect_serial();
 }
 
-Protocol::Protocol(protocol_config_t protocol_config) {
+Protocol::Protocol(protocol_config_t protocol_config, std::pmr::memory_resource *resource) : m_resource(pooled_resource(resource)), m_buffer(m_resource), m_pending(m_resource), m_fallback(m_resource) {
     m_version = protocol_config.version;
     m_sub_version = protocol_config.sub_version;
     m_address = protocol_config.address;
     m_verbose = protocol_config.verbose;
-    m_buffer = {};
-
+    m_start_time = m_stats_window.time = m_export_window.time = m_last_stats_export = std::chrono::steady_clock::now();
+    m_stats_interval = std::chrono::seconds(1);
+    m_reliable = false;
+    m_window = RELIABLE_WINDOW;
+    m_reliable_timeout = std::chrono::milliseconds(RELIABLE_TIMEOUT);
+    m_max_retries = RELIABLE_MAX_RETRY;
+    m_next_seq = 0;
+    m_failed_commands = 0;
+    m_sync_id = 0;
+    m_sync_pending = false;
+    m_sync_interval = std::chrono::milliseconds(0);
+    m_lazy_decode = false;
+
+    if (std::getenv(STAGE_PROFILER_ENV) && !stage_profiler_active) enable_stage_profiler();
+
+    m_serial.set_memory_resource(m_resource);
     m_serial.set_baudrate(protocol_config.baudrate);
     m_serial.set_verbose(protocol_config.verbose);
     m_serial.connect_serial();
 }
 
-void Protocol::decode_packet(std::vector<uint8_t> &packet, std::vector<uint8_t> &keys) {
-    uint8_t key, start_index, end_index;
-
-    // Decoding according to protocol rules
+// Key, first payload byte and timestamp flag according to protocol rules
+static bool frame_layout(const std::pmr::vector<uint8_t> &packet, uint8_t &key, uint8_t &start_index, bool &timestamped) {
+    timestamped = false;
     switch (packet[0]) {
         case INIT_SEQ:
             key = packet[0];
             start_index = 0;
-            break;
+            return true;
         case COMM_SEQ:
-            if (packet.size() < 5) return;
+            if (packet.size() < 5) return false;
             key = packet[3]; 
             start_index = 3;
-            break;
+            timestamped = packet[2] & TIMESTAMP_FLAG;
+            return true;
         case HB_SEQ:
             key = packet[0];
             start_index = 2;
-            break;
+            timestamped = packet[2] & TIMESTAMP_FLAG;
+            return true;
+    }
+    return false;
+}
+
+// Samples and timestamp flag of an aggregated frame, False: size not matching the count
+static bool aggregate_layout(const std::pmr::vector<uint8_t> &packet, size_t &count, bool &timestamped) {
+    count = packet[3] & ~TIMESTAMP_FLAG;
+    timestamped = packet[3] & TIMESTAMP_FLAG;
+    size_t size = 4 + count * AGGREGATE_TUPLE_SIZE + 2;
+    if (timestamped) size += TIMESTAMP_SIZE + count * AGGREGATE_OFFSET_SIZE;
+    return packet.size() == size;
+}
+
+static uint32_t big_endian_32(const uint8_t *bytes) {
+    return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) | (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+}
+
+// End of the payload: CRC and END_SEQ excluded, device timestamp too if the frame carries one
+static size_t payload_end(const std::pmr::vector<uint8_t> &packet, uint8_t start_index, bool timestamped) {
+    size_t end_index = packet.size() - 2;
+    if (timestamped && end_index >= start_index + TIMESTAMP_SIZE) end_index -= TIMESTAMP_SIZE;
+    return end_index;
+}
+
+void Protocol::decode_packet(std::pmr::vector<uint8_t> &packet, keys_t &keys) {
+    uint8_t key, start_index;
+    bool timestamped;
+
+    // Acks are not stored: every one of them counts, not only the newest
+    if (packet[0] == COMM_SEQ && packet.size() >= 7 && packet[2] == ACK_COMMAND) {
+        handle_ack(packet);
+        return;
+    }
+
+    if (packet[0] == COMM_SEQ && packet.size() >= 6 && packet[2] == AGGREGATE_COMMAND) {
+        handle_aggregate(packet, keys);
+        return;
+    }
+
+    if (packet[0] == COMM_SEQ && packet[2] == TIME_SYNC_RESPONSE) {
+        handle_time_sync(packet);
+        return;
     }
-    end_index = packet.size() - 2;
+
+    if (!frame_layout(packet, key, start_index, timestamped)) return;
+
+    m_counters.key_frames[key].fetch_add(1, std::memory_order_relaxed);
+    m_counters.key_bytes[key].fetch_add(packet.size(), std::memory_order_relaxed);
     
-    // Is in the map already?
-    if (std::find(keys.begin(), keys.end(), key) != keys.end()) return;
-    keys.push_back(key);
+    // Newer valid frame of the key already stored?
+    if (std::find(keys.begin(), keys.end(), key) != keys.end()) {
+        // Lazy: validity unknown, the first older frame is kept in case the newest one is corrupt
+        if (m_lazy_decode && !m_telemetry.is_open() && m_buffer[key].first == COMM_STATUS::FRAME_NOT_DECODED) {
+            packet_t &fallback = m_fallback[key];
+            if (fallback.first != COMM_STATUS::FRAME_NOT_DECODED) fallback = { COMM_STATUS::FRAME_NOT_DECODED, std::move(packet) };
+        }
+        return;
+    }
 
     if (m_verbose) std::cout << "[CHIMPANZEE] COLLECT -> " << std::hex << static_cast<int>(key) << std::dec << std::endl;
 
+    m_timing[key] = { std::nullopt, std::nullopt, m_arrival_time, {} };
+
+    // Lazy: keep the frame as it is (moved, no copy), see extract_payload
+    if (m_lazy_decode && !m_telemetry.is_open()) {
+        keys.push_back(key);
+        m_buffer[key] = { COMM_STATUS::FRAME_NOT_DECODED, std::move(packet) };
+        auto fallback = m_fallback.find(key);
+        if (fallback != m_fallback.end()) fallback->second = { COMM_STATUS::SERIAL_NOT_IN_BUFFER, std::nullopt }; // Older batch
+        return;
+    }
+
+    packet_t decoded = extract_payload(packet, key);
+
+    // A corrupt frame does not hide an older valid one of the same batch: CRC_FAILED stays only if none is valid
+    if (decoded.first == COMM_STATUS::OK) keys.push_back(key);
+
+    m_buffer[key] = std::move(decoded); 
+}
+
+// Lazy: newest raw frame of the key, then the fallback of the same batch if it is corrupt
+packet_t Protocol::decode_lazy(uint8_t key, const std::pmr::vector<uint8_t> &packet) {
+    packet_t decoded = extract_payload(packet, key);
+
+    auto fallback = m_fallback.find(key);
+    if (fallback == m_fallback.end() || fallback->second.first != COMM_STATUS::FRAME_NOT_DECODED) return decoded;
+
+    if (decoded.first != COMM_STATUS::OK) decoded = extract_payload(fallback->second.second.value(), key);
+    fallback->second = { COMM_STATUS::SERIAL_NOT_IN_BUFFER, std::nullopt };
+    return decoded;
+}
+
+// CRC check, device timestamp and payload slice of a stored frame
+packet_t Protocol::extract_payload(const std::pmr::vector<uint8_t> &packet, uint8_t key) {
+    uint8_t start_index;
+    bool timestamped;
+    frame_layout(packet, key, start_index, timestamped);
+
     // Is CRC 8 correct?
-    if (verify_response_CRC_8(packet) != COMM_STATUS::OK) m_buffer[key] = { COMM_STATUS::CRC_FAILED, std::nullopt };
+    if (verify_response_CRC_8(packet) != COMM_STATUS::OK) {
+        m_counters.crc_failures.fetch_add(1, std::memory_order_relaxed);
+        return { COMM_STATUS::CRC_FAILED, std::nullopt };
+    }
+
+    size_t end_index = payload_end(packet, start_index, timestamped);
+
+    // Device timestamp (big endian) between payload and CRC
+    if (end_index < packet.size() - 2) {
+        uint32_t device_us = big_endian_32(packet.data() + end_index);
+        m_clock.observe(device_us);
+        m_timing[key].device_us = device_us;
+        m_timing[key].sample_time = m_clock.to_host(device_us);
+    }
 
     // THE PACKET IS READY
-    std::vector<uint8_t> slice(packet.begin() + start_index, packet.begin() + end_index);
+    return { COMM_STATUS::OK, std::pmr::vector<uint8_t>(packet.begin() + start_index, packet.begin() + end_index, m_resource) };
+}
 
-    m_buffer[key] = { COMM_STATUS::OK, slice }; 
+// Bus: payload of a valid frame (every sample of an aggregated one, in order), the buffer is not touched
+void Protocol::publish_frame(const std::pmr::vector<uint8_t> &packet) {
+    uint8_t key, start_index;
+    bool timestamped;
+
+    if (packet[0] == COMM_SEQ && packet.size() >= 6 && packet[2] == AGGREGATE_COMMAND) {
+        size_t count;
+        if (!aggregate_layout(packet, count, timestamped) || verify_response_CRC_8(packet) != COMM_STATUS::OK) return;
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t *tuple = packet.data() + 4 + i * AGGREGATE_TUPLE_SIZE;
+            if (tuple[0] != RESERVED_BUFFER_KEY) m_telemetry.publish(tuple[0], packet[1], tuple, AGGREGATE_TUPLE_SIZE);
+        }
+        return;
+    }
+
+    // Acks and time sync answers are not telemetry
+    if (packet[0] == COMM_SEQ && ((packet.size() >= 7 && packet[2] == ACK_COMMAND) || packet[2] == TIME_SYNC_RESPONSE)) return;
+
+    if (!frame_layout(packet, key, start_index, timestamped) || verify_response_CRC_8(packet) != COMM_STATUS::OK) return;
+
+    m_telemetry.publish(key, packet[1], packet.data() + start_index, payload_end(packet, start_index, timestamped) - start_index);
 }
 
 
-bool Protocol::handle_buffer_reconstruction(std::vector<uint8_t> &packet, std::vector<uint8_t> &keys) {
+bool Protocol::handle_buffer_reconstruction(std::pmr::vector<uint8_t> &packet, keys_t &keys) {
     // Is the buffer empty?
     if (m_buffer.find(RESERVED_BUFFER_KEY) == m_buffer.end()) {
-        m_buffer[RESERVED_BUFFER_KEY] = {COMM_STATUS::OK, packet};
+        m_buffer[RESERVED_BUFFER_KEY] = {COMM_STATUS::OK, std::move(packet)};
         return false;
     }
 
-    // Update the buffer and check validity
-    std::vector<uint8_t> buffer_entry = m_buffer[RESERVED_BUFFER_KEY].second.value();
+    // Update the buffer (in place) and check validity
+    std::pmr::vector<uint8_t> &buffer_entry = m_buffer[RESERVED_BUFFER_KEY].second.value();
     buffer_entry.insert(buffer_entry.end(), packet.begin(), packet.end());
     if (is_valid_packet(buffer_entry)) {
-        m_buffer[RESERVED_BUFFER_KEY] = {COMM_STATUS::OK, buffer_entry};
-        remove_reserved_key(m_verbose, "REBUILT: ", m_buffer);
+        // Map nodes are stable, buffer_entry survives the insertions of decode_packet
+        if (m_telemetry.is_open()) publish_frame(buffer_entry); // Oldest frame of the stream
         decode_packet(buffer_entry, keys);
+        remove_reserved_key(m_verbose, "REBUILT: ", m_buffer);
+        m_counters.reassembly_successes.fetch_add(1, std::memory_order_relaxed);
         return true;
     } 
-    m_buffer[RESERVED_BUFFER_KEY] = {COMM_STATUS::OK, buffer_entry};
     return false;    
 }
 
-void Protocol::handle_packet_stream(std::vector<std::vector<uint8_t>> &packets) {
+void Protocol::handle_packet_stream(std::pmr::vector<std::pmr::vector<uint8_t>> &packets) {
     if (packets.size() == 0) return;
+    PROFILE_STAGE(STAGE_DECODE);
     
-    std::vector<uint8_t> keys = {};
+    keys_t keys(m_resource);
     int end = 0;
 
     // FROM INDEX 0 -> END, HERE WE TRY TO REBUILD THE BUFFER
@@ -97,6 +260,7 @@ void Protocol::handle_packet_stream(std::vector<std::vector<uint8_t>> &packets)
         // If the packet is correct, stop searching for a match, erase buffer
         if (is_valid_packet(packets[end])) {
             remove_reserved_key(m_verbose, "ERASED: ", m_buffer);
+            m_counters.reassembly_failures.fetch_add(1, std::memory_order_relaxed);
             break;
         }
 
@@ -107,16 +271,20 @@ void Protocol::handle_packet_stream(std::vector<std::vector<uint8_t>> &packets)
         // Too many keys in the buffer? Packet loss (or inadeguate reconstruction algorithm)!!!
         if (m_buffer[RESERVED_BUFFER_KEY].second.value().size() > 10) {
             remove_reserved_key(m_verbose, "ERASED: ", m_buffer); 
+            m_counters.reassembly_failures.fetch_add(1, std::memory_order_relaxed);
             break;        
         }
     }
 
     // We reset the keys vector, because there may be newer packet in the buffer
-    keys = {};     
+    keys.clear();     
 
     // Last element is complete? If not put in buffer
     if (!is_valid_packet(packets[packets.size() - 1])) handle_buffer_reconstruction(packets[packets.size() - 1], keys);
 
+    // Bus: every valid frame in arrival order, the buffer below keeps only the newest of each key
+    if (m_telemetry.is_open()) for (int i = end; i < packets.size(); i++) if (is_valid_packet(packets[i])) publish_frame(packets[i]);
+
     // READ PACKETs FINALLY
     for (int i = packets.size() - 1; i >= end; i--) if (is_valid_packet(packets[i])) decode_packet(packets[i], keys);
 }
@@ -132,12 +300,30 @@ bool Protocol::connect() {
     return m_serial.connect_serial();
 }
 
+bool Protocol::set_serial_tuning(const serial_tuning_t &tuning) {
+    m_serial.set_tuning(tuning);
+    if (!m_serial.check_connection()) return false;
+    m_serial.disconnect_serial();
+    return m_serial.connect_serial();
+}
+
+bool Protocol::set_serial_device(const std::string &device) {
+    m_serial.set_device(device);
+    return m_serial.connect_serial(); // Closes the current descriptor first
+}
+
 COMM_STATUS Protocol::init(uint8_t interval, uint8_t max_retries, uint8_t time_between_retries) {
     if (!m_serial.check_connection()) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;
     
     // Build INIT packet
-    std::vector<uint8_t> packet = {INIT_SEQ, m_address, m_version, m_sub_version, interval};
+    std::pmr::vector<uint8_t> packet({INIT_SEQ, m_address, m_version, m_sub_version, interval}, m_resource);
     packet.push_back(calculate_CRC_8(packet));
+
+    // Byte stuffing: the Nucleo frames INIT by END_SEQ like every other packet
+    size_t unescaped_size = packet.size();
+    add_escape_char(packet);
+    m_counters.escape_bytes_sent.fetch_add(packet.size() - unescaped_size, std::memory_order_relaxed);
+    m_counters.frames_sent.fetch_add(1, std::memory_order_relaxed);
     packet.push_back(END_SEQ); 
  
     
@@ -145,20 +331,16 @@ COMM_STATUS Protocol::init(uint8_t interval, uint8_t max_retries, uint8_t time_b
     
     if (written_bytes == -1) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;    
 
-    size_t retry = 0;
-    keys_t available_keys = update_buffer();
-
-    while (std::find(available_keys.begin(), available_keys.end(), INIT_SEQ) == available_keys.end() && retry < max_retries) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(time_between_retries));
-        available_keys = update_buffer();
-        retry++;
-    }
+    // Same budget of the old sleep-based retries, but the answer is read as soon as it arrives
+    keys_mask_t init_key;
+    init_key.set(INIT_SEQ);
+    wait_for(init_key, std::chrono::steady_clock::now() + std::chrono::milliseconds(max_retries * time_between_retries));
 
     packet_t res = get_packet(INIT_SEQ, END_SEQ);
  
     if (res.first != COMM_STATUS::OK) return res.first; 
 
-    std::vector<uint8_t> res_val = res.second.value();
+    std::pmr::vector<uint8_t> &res_val = res.second.value();
 
     if (m_version < res_val[2] || (m_version == res_val[2] && m_sub_version < res_val[3])) return COMM_STATUS::PI_OLD_VERSION;
 
@@ -168,7 +350,16 @@ COMM_STATUS Protocol::init(uint8_t interval, uint8_t max_retries, uint8_t time_b
 ssize_t Protocol::send_packet(uint8_t command, uint16_t *packet_array, size_t packet_array_length) {
     if (!m_serial.check_connection()) return -1;
     
-    std::vector<uint8_t> packet = {COMM_SEQ, m_address, command};
+    std::pmr::vector<uint8_t> packet({COMM_SEQ, m_address, command}, m_resource);
+    encode_comm_packet(packet, packet_array, packet_array_length);
+
+    return m_serial.send_byte_array(packet);
+}
+
+// Appends arguments, CRC, byte stuffing and END_SEQ to the header in packet
+void Protocol::encode_comm_packet(std::pmr::vector<uint8_t> &packet, uint16_t *packet_array, size_t packet_array_length) {
+    PROFILE_STAGE(STAGE_ENCODE);
+    packet.reserve(2 * (packet.size() + 2 * packet_array_length + 1) + 1); // Worst case: every byte escaped
 
     // Transform uint16_t -> 2 uint8_t
     for (int i = 0; i < packet_array_length; i++) {
@@ -183,34 +374,308 @@ ssize_t Protocol::send_packet(uint8_t command, uint16_t *packet_array, size_t pa
     packet.push_back(crc);
 
     // Byte stuffing 
+    size_t unescaped_size = packet.size();
     add_escape_char(packet);
+    m_counters.escape_bytes_sent.fetch_add(packet.size() - unescaped_size, std::memory_order_relaxed);
+    m_counters.frames_sent.fetch_add(1, std::memory_order_relaxed);
     
     packet.push_back(END_SEQ);
+}
 
-    return m_serial.send_byte_array(packet);
+void Protocol::enable_reliable_commands(uint8_t window, std::chrono::milliseconds timeout, uint8_t max_retries) {
+    m_reliable = true;
+    m_window = std::clamp<uint8_t>(window, 1, 128); // Larger windows make sequence numbers ambiguous
+    m_reliable_timeout = timeout;
+    m_max_retries = max_retries;
+
+    // Discarding pending output would drop the commands written back to back in the window
+    serial_tuning_t tuning = m_serial.get_tuning();
+    if (tuning.tx_strategy == TX_DISCARD_PENDING) {
+        tuning.tx_strategy = TX_APPEND;
+        m_serial.set_tuning(tuning);
+    }
+}
+
+int Protocol::send_reliable(uint8_t command, uint16_t *packet_array, size_t packet_array_length) {
+    if (!m_reliable || !m_serial.check_connection()) return -1;
+
+    uint8_t seq = m_next_seq++;
+    pending_command_t pending = { seq, std::pmr::vector<uint8_t>({COMM_SEQ, m_address, static_cast<uint8_t>(command | RELIABLE_FLAG), seq}, m_resource), {}, 0 };
+    encode_comm_packet(pending.frame, packet_array, packet_array_length);
+
+    m_pending.push_back(std::move(pending));
+    service_reliable();
+
+    return seq;
+}
+
+void Protocol::transmit_pending(pending_command_t &command) {
+    if (command.transmissions > 0) m_counters.retransmissions.fetch_add(1, std::memory_order_relaxed);
+    m_serial.send_byte_array(command.frame);
+    command.sent_at = std::chrono::steady_clock::now();
+    command.transmissions++;
+}
+
+// Fan out the (id, type, value) tuples: each sensor gets the same payload of a single sensor frame
+void Protocol::handle_aggregate(const std::pmr::vector<uint8_t> &packet, keys_t &keys) {
+    size_t count;
+    bool timestamped;
+    if (!aggregate_layout(packet, count, timestamped)) {
+        if (m_verbose) std::cout << "[CHIMPANZEE] MALFORMED AGGREGATE (" << count << " SAMPLES, " << packet.size() << " BYTES)" << std::endl;
+        return;
+    }
+
+    if (verify_response_CRC_8(packet) != COMM_STATUS::OK) {
+        m_counters.crc_failures.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    m_counters.aggregated_frames.fetch_add(1, std::memory_order_relaxed);
+
+    // Timestamped: t0 and the offsets follow the samples
+    const uint8_t *timestamps = packet.data() + 4 + count * AGGREGATE_TUPLE_SIZE;
+
+    // Newest tuple last: walk backwards, like the packet stream
+    for (size_t i = count; i-- > 0;) {
+        auto tuple = packet.begin() + 4 + i * AGGREGATE_TUPLE_SIZE;
+        uint8_t key = tuple[0];
+        if (key == RESERVED_BUFFER_KEY) continue;
+
+        m_counters.key_frames[key].fetch_add(1, std::memory_order_relaxed);
+        m_counters.key_bytes[key].fetch_add(AGGREGATE_TUPLE_SIZE, std::memory_order_relaxed);
+
+        if (std::find(keys.begin(), keys.end(), key) != keys.end()) continue;
+        keys.push_back(key);
+
+        std::pmr::vector<uint8_t> slice(tuple, tuple + AGGREGATE_TUPLE_SIZE, m_resource);
+
+        m_timing[key] = { std::nullopt, std::nullopt, m_arrival_time, {} };
+        if (timestamped) {
+            const uint8_t *offset = timestamps + TIMESTAMP_SIZE + i * AGGREGATE_OFFSET_SIZE;
+            uint32_t device_us = big_endian_32(timestamps) + ((static_cast<uint32_t>(offset[0]) << 8) | offset[1]);
+            m_clock.observe(device_us);
+            m_timing[key].device_us = device_us;
+            m_timing[key].sample_time = m_clock.to_host(device_us);
+        }
+        m_buffer[key] = { COMM_STATUS::OK, std::move(slice) };
+    }
+}
+
+// AA addr 7C id_low id_high t2 t3 CRC EE (t2, t3 big endian micros())
+void Protocol::handle_time_sync(const std::pmr::vector<uint8_t> &packet) {
+    if (packet.size() != 15) return;
+    if (verify_response_CRC_8(packet) != COMM_STATUS::OK) {
+        m_counters.crc_failures.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint16_t id = packet[3] | (static_cast<uint16_t>(packet[4]) << 8);
+    if (!m_sync_pending || id != m_sync_id) return; // Late answer of an expired request
+    m_sync_pending = false;
+
+    uint32_t t2 = big_endian_32(packet.data() + 5);
+    uint32_t t3 = big_endian_32(packet.data() + 9);
+
+    m_clock.add_exchange(m_sync_sent_at, t2, t3, m_arrival_time);
+
+    if (m_verbose) std::cout << "[CHIMPANZEE] CLOCK OFFSET " << m_clock.get_offset_us() << " us, ROUND TRIP " << m_clock.get_round_trip_us() << " us, DRIFT " << m_clock.get_drift_ppm() << " ppm" << std::endl;
+}
+
+bool Protocol::request_time_sync() {
+    uint16_t id = ++m_sync_id;
+    m_sync_sent_at = std::chrono::steady_clock::now();
+    if (send_packet(COMM_TYPE::TIME_SYNC, &id, 1) == -1) return false;
+    m_sync_pending = true;
+    return true;
+}
+
+COMM_STATUS Protocol::sync_clock(uint8_t exchanges, std::chrono::milliseconds timeout) {
+    if (!m_serial.check_connection()) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;
+    bool synchronized = false;
+
+    for (uint8_t i = 0; i < exchanges; i++) {
+        if (!request_time_sync()) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;
+
+        auto deadline = m_sync_sent_at + timeout;
+        while (m_sync_pending) {
+            read_serial();
+            auto now = std::chrono::steady_clock::now();
+            if (!m_sync_pending || now >= deadline) break;
+            if (m_serial.wait_for_data(deadline - now) < 0) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;
+        }
+
+        if (!m_sync_pending) synchronized = true;
+        m_sync_pending = false;
+    }
+
+    return synchronized ? COMM_STATUS::OK : COMM_STATUS::NUCLEO_TIMEOUT;
+}
+
+void Protocol::set_clock_sync_interval(std::chrono::milliseconds interval) {
+    m_sync_interval = interval;
+
+    // The request leaves from wait_for, a command written right after would flush it half sent
+    serial_tuning_t tuning = m_serial.get_tuning();
+    if (interval.count() > 0 && tuning.tx_strategy == TX_DISCARD_PENDING) {
+        tuning.tx_strategy = TX_APPEND;
+        m_serial.set_tuning(tuning);
+    }
+}
+
+void Protocol::handle_ack(const std::pmr::vector<uint8_t> &packet) {
+    if (verify_response_CRC_8(packet) != COMM_STATUS::OK) {
+        m_counters.crc_failures.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint8_t seq = packet[3];
+    auto command = std::find_if(m_pending.begin(), m_pending.end(), [seq](const pending_command_t &c) { return c.seq == seq && c.transmissions > 0; });
+    if (command == m_pending.end()) return; // Duplicate ack of a retransmission
+
+    if (packet[4] == ACK_OK) {
+        m_counters.acks.fetch_add(1, std::memory_order_relaxed);
+        m_pending.erase(command);
+        return;
+    }
+
+    // NACK: resend only this command, now
+    m_counters.nacks.fetch_add(1, std::memory_order_relaxed);
+    if (m_verbose) std::cout << "[CHIMPANZEE] NACK -> " << static_cast<int>(seq) << std::endl;
+    if (command->transmissions > m_max_retries) {
+        m_counters.command_failures.fetch_add(1, std::memory_order_relaxed);
+        m_failed_commands++;
+        m_pending.erase(command);
+        return;
+    }
+    transmit_pending(*command);
+}
+
+void Protocol::service_reliable() {
+    if (m_pending.empty() || !m_serial.check_connection()) return;
+    auto now = std::chrono::steady_clock::now();
+
+    // Selective retransmission of the timed out commands
+    for (auto command = m_pending.begin(); command != m_pending.end();) {
+        if (command->transmissions == 0 || now - command->sent_at < m_reliable_timeout) {
+            command++;
+            continue;
+        }
+        if (command->transmissions > m_max_retries) {
+            std::cerr << "[CHIMPANZEE] RELIABLE COMMAND " << static_cast<int>(command->seq) << " GIVEN UP" << std::endl;
+            m_counters.command_failures.fetch_add(1, std::memory_order_relaxed);
+            m_failed_commands++;
+            command = m_pending.erase(command);
+            continue;
+        }
+        transmit_pending(*command);
+        command++;
+    }
+
+    // Fill the window with queued commands
+    size_t in_flight = std::count_if(m_pending.begin(), m_pending.end(), [](const pending_command_t &c) { return c.transmissions > 0; });
+    for (auto &command : m_pending) {
+        if (in_flight >= m_window) break;
+        if (command.transmissions > 0) continue;
+        transmit_pending(command);
+        in_flight++;
+    }
+}
+
+COMM_STATUS Protocol::flush_reliable(std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        read_serial();
+
+        if (m_pending.empty()) {
+            COMM_STATUS status = m_failed_commands == 0 ? COMM_STATUS::OK : COMM_STATUS::NUCLEO_TIMEOUT;
+            m_failed_commands = 0;
+            return status;
+        }
+        if (!m_serial.check_connection()) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;
+
+        // Wake up for the next ack or, at most, for the next retransmission
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) return COMM_STATUS::NUCLEO_TIMEOUT;
+
+        auto wake_up = deadline;
+        for (const auto &command : m_pending) {
+            if (command.transmissions > 0) wake_up = std::min(wake_up, command.sent_at + m_reliable_timeout);
+        }
+        if (m_serial.wait_for_data(wake_up - now) < 0) return COMM_STATUS::SERIAL_NOT_ESTABLISHED;
+    }
 }
 
 packet_t Protocol::get_packet(uint8_t start_byte, uint8_t end_byte) {
     if (!m_serial.check_connection()) return {COMM_STATUS::SERIAL_NOT_ESTABLISHED, std::nullopt}; 
     
     // In order to avoid this type of error, use update_buffer keys in start_byte
-    if (m_buffer.find(start_byte) == m_buffer.end()) return {COMM_STATUS::SERIAL_NOT_IN_BUFFER, std::nullopt};
+    auto entry = m_buffer.find(start_byte);
+    if (entry == m_buffer.end()) return {COMM_STATUS::SERIAL_NOT_IN_BUFFER, std::nullopt};
 
-    packet_t packet = m_buffer[start_byte];
+    packet_t packet = std::move(entry->second);
 
-    m_buffer.erase(start_byte);
+    m_buffer.erase(entry);
+
+    if (packet.first == COMM_STATUS::FRAME_NOT_DECODED) packet = decode_lazy(start_byte, packet.second.value());
+
+    m_consumed_timing[start_byte] = m_timing[start_byte];
+    m_consumed_timing[start_byte].consume_time = std::chrono::steady_clock::now();
 
     return packet;
 }
 
-keys_t Protocol::update_buffer() { 
-    std::vector<std::vector<uint8_t>> packets = m_serial.get_byte_vectors(END_SEQ, ESCAPE_CHAR);
+void Protocol::read_serial() {
+    std::pmr::vector<std::pmr::vector<uint8_t>> packets = m_serial.get_byte_vectors(END_SEQ, ESCAPE_CHAR);
+    m_arrival_time = std::chrono::steady_clock::now();
     
     handle_packet_stream(packets);
 
+    service_reliable();
+
+    // Periodic exchange, an unanswered one is replaced after the interval
+    if (m_sync_interval.count() > 0 && m_arrival_time - m_sync_sent_at >= m_sync_interval) request_time_sync();
+
+    if (!m_stats_path.empty() && std::chrono::steady_clock::now() - m_last_stats_export >= m_stats_interval) {
+        m_last_stats_export = std::chrono::steady_clock::now();
+        write_prometheus_stats(snapshot(m_export_window), m_stats_path); // Own window: stats() calls do not shorten it
+    }
+}
+
+keys_t Protocol::update_buffer() { 
+    read_serial();
+
     return get_keys(m_buffer);
 }
 
+keys_mask_t Protocol::wait_for(keys_mask_t keys, std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        read_serial();
+
+        // Fresh frame -> in the buffer and valid (a raw one of a waited key is decoded here, once)
+        for (auto &entry : m_buffer) {
+            if (entry.first == RESERVED_BUFFER_KEY || !keys.test(entry.first)) continue;
+            if (entry.second.first == COMM_STATUS::FRAME_NOT_DECODED) entry.second = decode_lazy(entry.first, entry.second.second.value());
+            if (entry.second.first == COMM_STATUS::OK) keys.reset(entry.first);
+        }
+        if (keys.none()) return keys;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) return keys;
+
+        // Serial lost or hung up: waiting is pointless
+        if (m_serial.wait_for_data(deadline - now) < 0) return keys;
+    }
+}
+
+keys_t Protocol::wait_for(const keys_t &keys, std::chrono::steady_clock::time_point deadline) {
+    keys_mask_t mask;
+    for (uint8_t key : keys) mask.set(key);
+
+    mask = wait_for(mask, deadline);
+
+    keys_t missing(m_resource);
+    for (uint8_t key : keys) if (mask.test(key)) missing.push_back(key);
+    return missing;
+}
+
 bool Protocol::set_sensor(sensor_config_t sensor) {
     if (sensor.id == RESERVED_BUFFER_KEY) {
         std::cerr << "This ID is reserved" << std::endl;
@@ -221,6 +686,7 @@ bool Protocol::set_sensor(sensor_config_t sensor) {
     p_sensor[0] = (static_cast<uint16_t>(sensor.id) << 8) | sensor.i2c_address;
     p_sensor[1] = (static_cast<uint16_t>(sensor.interval_key) << 8) | sensor.type;
 
+    if (m_reliable) return send_reliable(COMM_TYPE::SENSOR, p_sensor, 2) != -1;
     return send_packet(COMM_TYPE::SENSOR, p_sensor, 2) != -1;
 }
 
@@ -232,6 +698,78 @@ packet_t Protocol::get_sensor(uint8_t ID) {
     return get_packet(ID);
 }
 
+void Protocol::set_lazy_decode(bool lazy) {
+    m_lazy_decode = lazy;
+}
+
+bool Protocol::enable_telemetry_bus(const std::string &name, uint32_t capacity) {
+    return m_telemetry.open(name, capacity);
+}
+
+void Protocol::disable_telemetry_bus() {
+    m_telemetry.close();
+}
+
+realtime_report_t Protocol::set_realtime_profile(const realtime_config_t &config) {
+    // Buckets for every key now, no rehash (and no new pages) in the hot path
+    m_buffer.reserve(256);
+
+    return apply_realtime_profile(config);
+}
+
+protocol_stats_t Protocol::stats() {
+    return snapshot(m_stats_window);
+}
+
+// Counters now, rates since the start of window (moved to now)
+protocol_stats_t Protocol::snapshot(stats_window_t &window) {
+    const serial_counters_t &serial = m_serial.get_counters();
+    auto now = std::chrono::steady_clock::now();
+    protocol_stats_t snapshot;
+
+    snapshot.uptime_s = std::chrono::duration<double>(now - m_start_time).count();
+    snapshot.window_s = std::chrono::duration<double>(now - window.time).count();
+    snapshot.bytes_received = serial.bytes_received.load(std::memory_order_relaxed);
+    snapshot.bytes_sent = serial.bytes_sent.load(std::memory_order_relaxed);
+    snapshot.frames_received = serial.frames_received.load(std::memory_order_relaxed);
+    snapshot.frames_sent = m_counters.frames_sent.load(std::memory_order_relaxed);
+    snapshot.escape_bytes_received = serial.escape_bytes_received.load(std::memory_order_relaxed);
+    snapshot.escape_bytes_sent = m_counters.escape_bytes_sent.load(std::memory_order_relaxed);
+    snapshot.crc_failures = m_counters.crc_failures.load(std::memory_order_relaxed);
+    snapshot.reassembly_successes = m_counters.reassembly_successes.load(std::memory_order_relaxed);
+    snapshot.reassembly_failures = m_counters.reassembly_failures.load(std::memory_order_relaxed);
+    snapshot.aggregated_frames = m_counters.aggregated_frames.load(std::memory_order_relaxed);
+    snapshot.acks = m_counters.acks.load(std::memory_order_relaxed);
+    snapshot.nacks = m_counters.nacks.load(std::memory_order_relaxed);
+    snapshot.retransmissions = m_counters.retransmissions.load(std::memory_order_relaxed);
+    snapshot.command_failures = m_counters.command_failures.load(std::memory_order_relaxed);
+    snapshot.max_packets_reached = serial.max_packets_reached.load(std::memory_order_relaxed);
+    snapshot.oversize_frames = serial.oversize_frames.load(std::memory_order_relaxed);
+
+    for (size_t key = 0; key < snapshot.keys.size(); key++) {
+        key_stats_t &entry = snapshot.keys[key];
+        entry.frames = m_counters.key_frames[key].load(std::memory_order_relaxed);
+        entry.bytes = m_counters.key_bytes[key].load(std::memory_order_relaxed);
+        entry.frames_per_second = snapshot.window_s > 0 ? (entry.frames - window.key_frames[key]) / snapshot.window_s : 0;
+        entry.bytes_per_second = snapshot.window_s > 0 ? (entry.bytes - window.key_bytes[key]) / snapshot.window_s : 0;
+        window.key_frames[key] = entry.frames;
+        window.key_bytes[key] = entry.bytes;
+    }
+    window.time = now;
+
+    return snapshot;
+}
+
+bool Protocol::export_stats(const std::string &path) {
+    return write_prometheus_stats(stats(), path);
+}
+
+void Protocol::set_stats_export(const std::string &path, std::chrono::milliseconds interval) {
+    m_stats_path = path;
+    m_stats_interval = interval;
+    m_last_stats_export = std::chrono::steady_clock::now();
+}
+
 packet_t Protocol::get_heartbeat() {
     return get_packet(HB_SEQ);
 }
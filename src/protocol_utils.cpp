@@ -1,47 +1,47 @@
 #include "protocol_utils.hpp"
+#include "stage_profiler.hpp"
+
+#include <cstdio>
+#include <fstream>
 
 // Utils -> Private
 
-void print_vec(std::vector<uint8_t> val) {
+void print_vec(const std::pmr::vector<uint8_t> &val) {
     for (int i = 0; i < val.size(); i++) std::cout << std::hex << static_cast<int>(val[i]) << " ";
     std::cout << std::dec << std::endl;
 }
 
-uint8_t calculate_CRC_8(const std::vector<uint8_t>& data) {
-    uint8_t crc = 0x00;
+static inline uint8_t update_CRC_8(uint8_t crc, uint8_t byte) {
     uint8_t polynomial = 0x07; 
-    for (auto byte : data) {
-        crc ^= byte; 
-        for (int i = 0; i < 8; i++) {
-            if (crc & 0x80) crc = (crc << 1) ^ polynomial;
-            else crc <<= 1;
-        }
+    crc ^= byte; 
+    for (int i = 0; i < 8; i++) {
+        if (crc & 0x80) crc = (crc << 1) ^ polynomial;
+        else crc <<= 1;
     }
     return crc;
 }
 
-COMM_STATUS verify_response_CRC_8(const std::vector<uint8_t>& res) {
-    uint8_t res_crc = res[res.size() - 2];
+uint8_t calculate_CRC_8(const uint8_t *data, size_t length) {
+    PROFILE_STAGE(STAGE_CRC);
+    uint8_t crc = 0x00;
+    for (size_t i = 0; i < length; i++) crc = update_CRC_8(crc, data[i]);
+    return crc;
+}
 
-    std::vector<uint8_t> res_to_verify;
-    
-    // These lines exclude ESCAPE_CHAR from CRC calculation
-    for (size_t i = 0; i < res.size() - 2; i++) {
-        if (res[i] != ESCAPE_CHAR) {
-            res_to_verify.push_back(res[i]);
-        } 
-        else if (i + 1 < res.size() - 2 && res[i + 1] == ESCAPE_CHAR) {
-            res_to_verify.push_back(res[i + 1]);
-            i++;
-        }
-    } 
+uint8_t calculate_CRC_8(const std::pmr::vector<uint8_t>& data) {
+    return calculate_CRC_8(data.data(), data.size());
+}
 
-    uint8_t crc_to_verify = calculate_CRC_8(res_to_verify);
+COMM_STATUS verify_response_CRC_8(const std::pmr::vector<uint8_t>& res) {
+    uint8_t res_crc = res[res.size() - 2];
+
+    // Serial already removed the byte stuffing: a 0x7E left here is data and belongs to the CRC
+    uint8_t crc_to_verify = calculate_CRC_8(res.data(), res.size() - 2);
 
     return res_crc != crc_to_verify ? COMM_STATUS::CRC_FAILED : COMM_STATUS::OK; 
 }
 
-void add_escape_char(std::vector<uint8_t>& vec) {
+void add_escape_char(std::pmr::vector<uint8_t>& vec) {
     for (int i = vec.size() - 1; i > 0; i--) {
         if (std::find(bytes_to_escape, bytes_to_escape + NUM_SEQ + 2, vec[i]) != bytes_to_escape + NUM_SEQ + 2) {
             vec.insert(vec.begin() + i, ESCAPE_CHAR);    
@@ -49,23 +49,82 @@ void add_escape_char(std::vector<uint8_t>& vec) {
     }
 }
 
-keys_t get_keys(std::unordered_map<uint8_t, packet_t> buffer) {
-    keys_t available_keys;
-    for (auto pair : buffer) if (pair.first != RESERVED_BUFFER_KEY) available_keys.push_back(pair.first);
+keys_t get_keys(const buffer_t &buffer) {
+    keys_t available_keys(buffer.get_allocator().resource());
+    available_keys.reserve(buffer.size());
+    for (const auto &pair : buffer) if (pair.first != RESERVED_BUFFER_KEY) available_keys.push_back(pair.first);
     return available_keys;
 }
 
-bool is_valid_packet(std::vector<uint8_t> packet) {
+bool is_valid_packet(const std::pmr::vector<uint8_t> &packet) {
     size_t dim = packet.size();
     return dim > 4 // Minimum dimension (minum packet without byte stuffing)
     && std::find(start_bytes, start_bytes + NUM_SEQ, packet[0]) != start_bytes + NUM_SEQ // Is a start of packet?
     && packet[dim - 1] == END_SEQ; // Ends with END_SEQ?
 }
 
-void remove_reserved_key(bool verbose, std::string content, std::unordered_map<uint8_t, packet_t> &buffer) {
+void remove_reserved_key(bool verbose, const char *content, buffer_t &buffer) {
     if (verbose) {
         std::cout << content << std::endl;
         print_vec(buffer[RESERVED_BUFFER_KEY].second.value());
     }
     buffer.erase(RESERVED_BUFFER_KEY); 
 }
+
+static void write_counter(std::ofstream &out, const char *name, const char *help, uint64_t value) {
+    out << "# HELP chimpanzee_" << name << " " << help << "\n";
+    out << "# TYPE chimpanzee_" << name << " counter\n";
+    out << "chimpanzee_" << name << " " << value << "\n";
+}
+
+bool write_prometheus_stats(const protocol_stats_t &stats, const std::string &path) {
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::trunc);
+    if (!out) return false;
+
+    write_counter(out, "bytes_received_total", "Bytes read from the serial", stats.bytes_received);
+    write_counter(out, "bytes_sent_total", "Bytes written to the serial", stats.bytes_sent);
+    write_counter(out, "frames_received_total", "Frames terminated by END_SEQ", stats.frames_received);
+    write_counter(out, "frames_sent_total", "INIT and COMM frames sent, retransmissions excluded", stats.frames_sent);
+    write_counter(out, "escape_bytes_received_total", "Byte stuffing overhead in reception", stats.escape_bytes_received);
+    write_counter(out, "escape_bytes_sent_total", "Byte stuffing overhead in transmission", stats.escape_bytes_sent);
+    write_counter(out, "crc_failures_total", "Frames discarded by CRC-8", stats.crc_failures);
+    write_counter(out, "reassembly_successes_total", "Fragmented frames rebuilt", stats.reassembly_successes);
+    write_counter(out, "reassembly_failures_total", "Fragments erased without a match", stats.reassembly_failures);
+    write_counter(out, "aggregated_frames_total", "Aggregated telemetry frames received", stats.aggregated_frames);
+    write_counter(out, "acks_total", "Reliable commands acknowledged", stats.acks);
+    write_counter(out, "nacks_total", "Reliable commands refused by the Nucleo", stats.nacks);
+    write_counter(out, "retransmissions_total", "Reliable commands sent again", stats.retransmissions);
+    write_counter(out, "command_failures_total", "Reliable commands given up", stats.command_failures);
+    write_counter(out, "max_packets_reached_total", "Reads stopped by MAX_PACKETS", stats.max_packets_reached);
+    write_counter(out, "oversize_frames_total", "Frames cut by MAX_PACKET_SIZE", stats.oversize_frames);
+
+    out << "# HELP chimpanzee_uptime_seconds Seconds since the Protocol was created\n";
+    out << "# TYPE chimpanzee_uptime_seconds gauge\n";
+    out << "chimpanzee_uptime_seconds " << stats.uptime_s << "\n";
+
+    out << "# HELP chimpanzee_key_frames_received_total Frames (or aggregated samples) received per key, before the CRC check of single frames, overwritten ones included\n";
+    out << "# TYPE chimpanzee_key_frames_received_total counter\n";
+    for (size_t key = 0; key < stats.keys.size(); key++) {
+        if (stats.keys[key].frames) out << "chimpanzee_key_frames_received_total{key=\"" << key << "\"} " << stats.keys[key].frames << "\n";
+    }
+    out << "# HELP chimpanzee_key_bytes_received_total Bytes received per key, before the CRC check of single frames\n";
+    out << "# TYPE chimpanzee_key_bytes_received_total counter\n";
+    for (size_t key = 0; key < stats.keys.size(); key++) {
+        if (stats.keys[key].frames) out << "chimpanzee_key_bytes_received_total{key=\"" << key << "\"} " << stats.keys[key].bytes << "\n";
+    }
+    out << "# HELP chimpanzee_key_frames_per_second Frame rate per key over the last export window\n";
+    out << "# TYPE chimpanzee_key_frames_per_second gauge\n";
+    for (size_t key = 0; key < stats.keys.size(); key++) {
+        if (stats.keys[key].frames) out << "chimpanzee_key_frames_per_second{key=\"" << key << "\"} " << stats.keys[key].frames_per_second << "\n";
+    }
+    out << "# HELP chimpanzee_key_bytes_per_second Byte rate per key over the last export window\n";
+    out << "# TYPE chimpanzee_key_bytes_per_second gauge\n";
+    for (size_t key = 0; key < stats.keys.size(); key++) {
+        if (stats.keys[key].frames) out << "chimpanzee_key_bytes_per_second{key=\"" << key << "\"} " << stats.keys[key].bytes_per_second << "\n";
+    }
+
+    out.close();
+    if (!out) return false;
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
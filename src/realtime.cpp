@@ -0,0 +1,111 @@
+#include "realtime.hpp"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Utils -> Private
+
+static void report_failure(const char *step, int error) {
+    std::cerr << "\033[33m" << "[REALTIME] " << step << " NOT APPLIED: " << std::strerror(error) << "\033[0m" << std::endl;
+}
+
+// noinline: the frame must really be allocated, not folded into the caller
+static __attribute__((noinline)) void prefault_stack(size_t size) {
+    volatile unsigned char *stack = static_cast<volatile unsigned char *>(alloca(size));
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < size; i += page) stack[i] = 0;
+}
+
+static int64_t to_ns(const struct timespec &ts) {
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+realtime_report_t apply_realtime_profile(const realtime_config_t &config) {
+    realtime_report_t report = { false, false, false, false };
+    int res;
+
+    if (config.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.cpu, &set);
+        res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (res == 0) report.pinned = true;
+        else report_failure("CPU PINNING", res);
+    }
+
+    if (config.fifo) {
+        struct sched_param param;
+        param.sched_priority = std::clamp(config.priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+        res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (res == 0) report.fifo = true;
+        else report_failure("SCHED_FIFO", res);
+    }
+
+    if (config.lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) report.memory_locked = true;
+        else report_failure("MLOCKALL", errno);
+    }
+
+    // Without locked memory the pages could be reclaimed again, still better than faulting in the hot path
+    if (config.prefault_stack > 0) {
+        prefault_stack(config.prefault_stack);
+        report.prefaulted = true;
+    }
+
+    std::cout << "[REALTIME] PINNED: " << report.pinned << " FIFO: " << report.fifo
+              << " LOCKED: " << report.memory_locked << " PREFAULTED: " << report.prefaulted << std::endl;
+
+    return report;
+}
+
+latency_stats_t measure_wakeup_latency(std::chrono::microseconds period, size_t samples) {
+    latency_stats_t stats = { 0, 0, 0, 0, 0, 0, 0 };
+    if (samples == 0) return stats;
+
+    std::vector<double> latencies;
+    latencies.reserve(samples);
+
+    struct timespec target, now;
+    clock_gettime(CLOCK_MONOTONIC, &target);
+
+    for (size_t i = 0; i < samples; i++) {
+        int64_t next = to_ns(target) + std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+        target.tv_sec = next / 1000000000;
+        target.tv_nsec = next % 1000000000;
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, nullptr) == EINTR);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        latencies.push_back((to_ns(now) - to_ns(target)) / 1000.0);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    stats.samples = samples;
+    stats.min = latencies.front();
+    stats.p50 = percentile(latencies, 0.50);
+    stats.p90 = percentile(latencies, 0.90);
+    stats.p99 = percentile(latencies, 0.99);
+    stats.p999 = percentile(latencies, 0.999);
+    stats.max = latencies.back();
+    return stats;
+}
+
+void print_latency_stats(const char *label, const latency_stats_t &stats) {
+    std::cout << "[REALTIME] " << label << " (" << stats.samples << " wake-ups, us)"
+              << " min: " << stats.min << " p50: " << stats.p50 << " p90: " << stats.p90
+              << " p99: " << stats.p99 << " p99.9: " << stats.p999 << " max: " << stats.max << std::endl;
+}
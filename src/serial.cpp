@@ -1,6 +1,7 @@
 #include <iostream>
 #include <chrono>
 #include "serial.hpp"
+#include "stage_profiler.hpp"
 #include <termios.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -8,6 +9,9 @@
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <signal.h>
 
 
 #define MAX_PACKETS 100
@@ -16,22 +20,41 @@
 
 const std::vector<std::string> serial_prefixes = {"/dev/ttyS"};
 
+// serial_baud.cpp
+int set_custom_baudrate(int fd, int baud);
+
+serial_tuning_t low_latency_serial_tuning() {
+    serial_tuning_t tuning;
+    tuning.low_latency = true;
+    tuning.custom_baudrate = true;
+    tuning.vmin = 0;
+    tuning.vtime = 0;
+    tuning.open_settle_us = 0;
+    tuning.rx_strategy = RX_FLUSH_ON_OPEN;
+    tuning.tx_strategy = TX_APPEND;
+    return tuning;
+}
+
 Serial::Serial() {
     m_connected = false;
     m_fd = -1;
     m_verbose = false;
     m_baudrate = 9600;
+    m_resource = std::pmr::get_default_resource();
+    m_rx_head = m_rx_tail = 0;
 }
 
 
 // wiringPi sucks
 // #include "wiringSerial.h"
 // Stolen from WiringPi:
-int serialOpen (const char *device, const int baud)
+// Tuning added on top: see serial_tuning_t
+int serialOpen (const char *device, const int baud, const serial_tuning_t &tuning)
 {
   struct termios options ;
   speed_t myBaud ;
   int     status, fd ;
+  bool    custom = false ;
 
   switch (baud)
   {
@@ -67,10 +90,14 @@ int serialOpen (const char *device, const int baud)
     case 4000000:	myBaud = B4000000 ; break ;
 
     default:
-      return -2 ;
+      if (!tuning.custom_baudrate) return -2 ;
+      myBaud = B38400 ; // Placeholder, replaced through termios2
+      custom = true ;
+      break ;
   }
 
-  if ((fd = open (device, O_RDWR | O_NOCTTY | O_NDELAY | O_ASYNC )) == -1)
+  // O_ASYNC of the original wiringPi code dropped: open() ignores it and F_SETFL below would clear it anyway
+  if ((fd = open (device, O_RDWR | O_NOCTTY | O_NDELAY )) == -1)
     return -1 ;
 
   fcntl (fd, F_SETFL, O_RDWR | O_NONBLOCK | O_NOCTTY | O_NDELAY );
@@ -92,10 +119,31 @@ int serialOpen (const char *device, const int baud)
     options.c_oflag &= ~OPOST ;
     options.c_oflag = 0;
 
-    options.c_cc [VMIN] = 0;
-    options.c_cc[VTIME] = 100;	// Ten seconds (100 deciseconds)
+    options.c_cc [VMIN] = tuning.vmin;
+    options.c_cc[VTIME] = tuning.vtime;	// Default: ten seconds (100 deciseconds)
+
+    // TCSAFLUSH also discards pending input
+    tcsetattr (fd, tuning.rx_strategy == RX_FLUSH_ON_OPEN ? TCSAFLUSH : TCSANOW, &options);
+
+    if (custom) {
+      int actual = set_custom_baudrate (fd, baud) ;
+      if (actual == -1) {
+        std::cerr << "\033[31m" << "[SERIAL] BAUDRATE " << baud << " NOT SUPPORTED BY " << device << "\033[0m" << std::endl;
+        close (fd) ;
+        return -2 ;
+      }
+      if (actual != baud) std::cerr << "\033[31m" << "[SERIAL] BAUDRATE " << baud << " ROUNDED TO " << actual << "\033[0m" << std::endl;
+    }
 
-    tcsetattr (fd, TCSAFLUSH, &options);
+    // Drivers without TIOCSSERIAL (ptys, some USB adapters) keep their default latency
+    if (tuning.low_latency) {
+      struct serial_struct serinfo ;
+      if (ioctl (fd, TIOCGSERIAL, &serinfo) == 0) {
+        serinfo.flags |= ASYNC_LOW_LATENCY ;
+        if (ioctl (fd, TIOCSSERIAL, &serinfo) != 0) std::cerr << "\033[31m" << "[SERIAL] ASYNC_LOW_LATENCY REFUSED BY " << device << "\033[0m" << std::endl;
+      }
+      else std::cerr << "\033[31m" << "[SERIAL] ASYNC_LOW_LATENCY NOT SUPPORTED BY " << device << "\033[0m" << std::endl;
+    }
 
     ioctl (fd, TIOCMGET, &status);
 
@@ -104,7 +152,7 @@ int serialOpen (const char *device, const int baud)
 
     ioctl (fd, TIOCMSET, &status);
 
-    usleep(10000);	// 10mS
+    if (tuning.open_settle_us > 0) usleep(tuning.open_settle_us);	// Default: 10mS
 
     return fd ;
 }
@@ -115,24 +163,41 @@ int Serial::connect_serial() {
     int max_tries = 10;
 
     std::cout << "[SERIAL] Trying connecting to serial..." << std::endl;
+
+    // Descriptor of an unplugged device is still open
+    disconnect_serial();
+
+    // Explicit (or last used) device first
+    if (!m_device.empty()) {
+        m_fd = serialOpen(m_device.c_str(), m_baudrate, m_tuning);
+        if (m_fd > -1) {
+            std::cout << "[SERIAL] " << "Connected to: " << m_device << std::endl;
+            if (m_tuning.rx_strategy == RX_FLUSH_ON_OPEN) tcflush(m_fd, TCIOFLUSH);
+            m_rx_head = m_rx_tail = 0;
+            m_connected = true;
+            return true;
+        }
+    }
  
     // Try to connect to different serial interfaces
     for (const std::string serial_prefix: serial_prefixes) {
         for (int i = 0; i < max_tries; i++) {
             
             serial_interface = serial_prefix + std::to_string(i);
-            m_fd = serialOpen(serial_interface.c_str(), m_baudrate);
+            m_fd = serialOpen(serial_interface.c_str(), m_baudrate, m_tuning);
             if (m_fd > -1) { 
 
                 m_device = serial_interface;
                 std::cout << "[SERIAL] " << "Connected to: " << serial_interface << std::endl;                
-                tcflush(m_fd, TCIOFLUSH);
+                if (m_tuning.rx_strategy == RX_FLUSH_ON_OPEN) tcflush(m_fd, TCIOFLUSH);
+                m_rx_head = m_rx_tail = 0;
                 m_connected = true;
                 return true;
 
             }
         }
     }
+    m_fd = -1; // serialOpen returns -2 for an unsupported baud rate
     m_connected = false;
     return false;
 }
@@ -141,7 +206,25 @@ int Serial::get_available_data() {
     if (!check_connection()) return -1;
     int num;
     ioctl(m_fd, FIONREAD, &num);
-    return num; 
+    return num + (m_rx_tail - m_rx_head); 
+}
+
+int Serial::wait_for_data(std::chrono::nanoseconds timeout) {
+    if (!check_connection()) return -1;
+    if (timeout.count() < 0) timeout = std::chrono::nanoseconds(0);
+
+    struct pollfd pfd = { m_fd, POLLIN, 0 };
+    struct timespec ts;
+    ts.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(timeout).count();
+    ts.tv_nsec = (timeout - std::chrono::seconds(ts.tv_sec)).count();
+
+    if (m_rx_head < m_rx_tail) return 1; // Left by the last get_byte_vectors
+
+    int res = ppoll(&pfd, 1, &ts, nullptr);
+    if (res < 0) return errno == EINTR ? 0 : -1;
+    if (res == 0) return 0;
+    if (pfd.revents & POLLIN) return 1;
+    return -1; // POLLERR, POLLHUP, POLLNVAL
 }
 
 void Serial::set_verbose(bool val) {
@@ -152,6 +235,14 @@ void Serial::set_baudrate(int baudrate) {
     m_baudrate = baudrate;
 }
 
+void Serial::set_tuning(const serial_tuning_t &tuning) {
+    m_tuning = tuning;
+}
+
+void Serial::set_memory_resource(std::pmr::memory_resource *resource) {
+    m_resource = resource;
+}
+
 void Serial::set_device(std::string serial_interface) {
     m_device = serial_interface;
 }
@@ -160,21 +251,24 @@ std::string Serial::get_device() {
     return m_device;    
 }
 
+// Open descriptor and device still present (an unplugged USB adapter removes its node)
 bool Serial::check_connection() {
-    return access(m_device.c_str(), F_OK) == 0;
+    return m_fd >= 0 && access(m_device.c_str(), F_OK) == 0;
 }
 
 void Serial::disconnect_serial() {
-    close(m_fd);
+    if (m_fd >= 0) close(m_fd);
+    m_fd = -1;
+    m_connected = false;
 }
 
-void print_vec__(std::vector<uint8_t> val) {
+void print_vec__(const std::pmr::vector<uint8_t> &val) {
     for (int i = 0; i < val.size(); i++) std::cout << "  " << std::hex << static_cast<int>(val[i]) << " ";
     std::cout << std::dec << std::endl;
 }
 
-// This function get ALL the packets in the buffer, RIP dynamic allocation
-std::vector<std::vector<uint8_t>> Serial::get_byte_vectors(uint8_t terminal, uint8_t escape) {
+// This function get ALL the packets in the buffer, allocations come from m_resource
+std::pmr::vector<std::pmr::vector<uint8_t>> Serial::get_byte_vectors(uint8_t terminal, uint8_t escape) {
     if (!check_connection()) return {};
     uint8_t buffer[MAX_PACKETS][MAX_PACKET_SIZE] = {};
     size_t packet_lengths[MAX_PACKETS] = { 0 };
@@ -182,34 +276,67 @@ std::vector<std::vector<uint8_t>> Serial::get_byte_vectors(uint8_t terminal, uin
     ssize_t bytes_read = 0;
     uint8_t z;
     bool esc_mode = false;
-
-    while (packet_count < MAX_PACKETS - 1 && read(m_fd, &z, 1) > 0) { 
-        if (z == escape && !esc_mode) {
-            esc_mode = true;
-            continue;
+    uint64_t escape_count = 0;
+    uint64_t completed_count = 0;
+
+    bool oversize = false;
+
+    while (packet_count < MAX_PACKETS - 1 && !oversize) {
+        // Bulk read: one syscall per chunk instead of one per byte
+        if (m_rx_head == m_rx_tail) {
+            ssize_t chunk_size;
+            {
+                PROFILE_STAGE(STAGE_READ);
+                chunk_size = read(m_fd, m_rx_chunk.data(), m_rx_chunk.size());
+            }
+            if (chunk_size <= 0) break;
+            m_rx_head = 0;
+            m_rx_tail = chunk_size;
         }
 
-        if (packet_lengths[packet_count] < MAX_PACKET_SIZE) {
-            buffer[packet_count][packet_lengths[packet_count]++] = z;
-        }
-        else break;
+        PROFILE_STAGE(STAGE_FRAMING);
+        while (m_rx_head < m_rx_tail && packet_count < MAX_PACKETS - 1) {
+            z = m_rx_chunk[m_rx_head++];
+            bytes_read++;
+            if (z == escape && !esc_mode) {
+                esc_mode = true;
+                escape_count++;
+                continue;
+            }
 
-        if (z == terminal && !esc_mode) {
-            if ((++packet_count) < MAX_PACKETS) {
-                packet_lengths[packet_count] = 0;
+            if (packet_lengths[packet_count] < MAX_PACKET_SIZE) {
+                buffer[packet_count][packet_lengths[packet_count]++] = z;
+            }
+            else {
+                m_counters.oversize_frames.fetch_add(1, std::memory_order_relaxed);
+                oversize = true;
+                break;
+            }
+
+            if (z == terminal && !esc_mode) {
+                completed_count++;
+                if ((++packet_count) < MAX_PACKETS) {
+                    packet_lengths[packet_count] = 0;
+                }
             }
-        }
 
-        if (esc_mode) esc_mode = false;
+            if (esc_mode) esc_mode = false;
+        }
     }
 
     // EDGE CASES
     if (packet_count == 0 && packet_lengths[0] == 0) packet_count = -1;
-    if (packet_lengths[packet_count] == 0) packet_count -= 1;
+    if (packet_count >= 0 && packet_lengths[packet_count] == 0) packet_count -= 1;
 
+    m_counters.bytes_received.fetch_add(bytes_read, std::memory_order_relaxed);
+    m_counters.escape_bytes_received.fetch_add(escape_count, std::memory_order_relaxed);
+    m_counters.frames_received.fetch_add(completed_count, std::memory_order_relaxed);
+
+    if (packet_count == MAX_PACKETS - 2) m_counters.max_packets_reached.fetch_add(1, std::memory_order_relaxed);
     if (packet_count == MAX_PACKETS - 2) std::cerr << "\033[31m" << "[SERIAL] WARNING: CONSIDER TO ACCELERATE BUFFER UPDATING => MAX PACKETs REACHED => OLD PACKET READ" << "\033[0m" << std::endl;
 
-    std::vector<std::vector<uint8_t>> msg;
+    std::pmr::vector<std::pmr::vector<uint8_t>> msg(m_resource);
+    msg.reserve(MAX_PACKETS); // Same size every call: after warm-up a pool resource always has a free block
 
     for (ssize_t i = 0; i <= packet_count; i++) {
         msg.emplace_back(buffer[i], buffer[i] + packet_lengths[i]);
@@ -224,9 +351,15 @@ std::vector<std::vector<uint8_t>> Serial::get_byte_vectors(uint8_t terminal, uin
 }
 
 
-ssize_t Serial::send_byte_array(std::vector<uint8_t> bytes) {
-    tcflush(m_fd, TCOFLUSH);
-    ssize_t written_byte = write(m_fd, bytes.data(), bytes.size());
+ssize_t Serial::send_byte_array(const std::pmr::vector<uint8_t> &bytes) {
+    ssize_t written_byte;
+    {
+        PROFILE_STAGE(STAGE_WRITE);
+        if (m_tuning.tx_strategy == TX_DISCARD_PENDING) tcflush(m_fd, TCOFLUSH);
+        written_byte = write(m_fd, bytes.data(), bytes.size());
+        if (m_tuning.tx_strategy == TX_DRAIN && written_byte > 0) tcdrain(m_fd);
+    }
+    if (written_byte > 0) m_counters.bytes_sent.fetch_add(written_byte, std::memory_order_relaxed);
     if (m_verbose) {
         std::cout << "[SERIAL] SENT: " << std::endl;
         print_vec__(bytes);
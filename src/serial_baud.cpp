@@ -0,0 +1,21 @@
+// termios2 lives in asm/termbits.h, which clashes with glibc termios.h: keep it in its own unit
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+// Arbitrary baud rate through BOTHER, returns -1 if the driver refuses it
+int set_custom_baudrate(int fd, int baud) {
+    struct termios2 options;
+
+    if (ioctl(fd, TCGETS2, &options) == -1) return -1;
+
+    options.c_cflag &= ~CBAUD;
+    options.c_cflag |= BOTHER;
+    options.c_ispeed = baud;
+    options.c_ospeed = baud;
+
+    if (ioctl(fd, TCSETS2, &options) == -1) return -1;
+
+    // Drivers round to the closest rate they can generate, read it back
+    if (ioctl(fd, TCGETS2, &options) == -1) return -1;
+    return static_cast<int>(options.c_ospeed);
+}
@@ -0,0 +1,262 @@
+#include "stage_profiler.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+bool stage_profiler_active = false;
+
+static const char *stage_names[STAGE_COUNT] = { "READ", "FRAMING", "CRC", "DECODE", "ENCODE", "WRITE" };
+
+static std::array<stage_stats_t, STAGE_COUNT> stage_stats = {}; // Raw, probe cost included
+static std::array<uint64_t, STAGE_COUNT> stage_nested = {};     // Probes run inside each stage
+static stage_stats_t own_cost = {};    // Of an empty probe, as seen by itself
+static stage_stats_t nested_cost = {}; // Of an empty probe, as seen by the enclosing one
+static StageProbe *current_probe = nullptr;
+
+static int counter_fds[3] = { -1, -1, -1 }; // Cycles (group leader), instructions, cache misses
+static perf_event_mmap_page *counter_pages[3] = { nullptr, nullptr, nullptr };
+static size_t counter_count = 0; // Counters opened, read in this order
+static bool user_read = false;   // Every counter readable with rdpmc
+static bool exit_hook = false;
+
+// Utils -> Private
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int open_counter(uint64_t config, int leader, bool exclude_kernel) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = exclude_kernel; // With the kernel side the read()/write() syscalls are counted too
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0); // Calling thread, any CPU
+}
+
+static void close_counters() {
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < 3; i++) {
+        if (counter_pages[i] != nullptr) munmap(counter_pages[i], page);
+        counter_pages[i] = nullptr;
+    }
+    // Members first, the leader last
+    for (size_t i = 3; i-- > 0;) {
+        if (counter_fds[i] != -1) close(counter_fds[i]);
+        counter_fds[i] = -1;
+    }
+    counter_count = 0;
+    user_read = false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdpmc(uint32_t counter) {
+    uint32_t low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return low | (static_cast<uint64_t>(high) << 32);
+}
+
+// Self-monitoring read of the mmap'd page (see perf_event_open(2)), no syscall
+static bool read_user_counter(const perf_event_mmap_page *page, uint64_t &value) {
+    uint32_t sequence;
+    do {
+        sequence = page->lock;
+        asm volatile("" ::: "memory");
+        uint32_t index = page->index;
+        if (!page->cap_user_rdpmc || index == 0) return false; // Not scheduled on this CPU right now
+        uint64_t count = page->offset;
+        int shift = 64 - page->pmc_width;
+        count += static_cast<uint64_t>(static_cast<int64_t>(rdpmc(index - 1) << shift) >> shift);
+        value = count;
+        asm volatile("" ::: "memory");
+    } while (page->lock != sequence);
+    return true;
+}
+#else
+// rdpmc is x86 only: on ARM the kernel does not give user access to the PMU by default
+static bool read_user_counter(const perf_event_mmap_page *, uint64_t &) {
+    return false;
+}
+#endif
+
+static void map_counters() {
+    long page = sysconf(_SC_PAGESIZE);
+    user_read = true;
+    for (size_t i = 0; i < counter_count; i++) {
+        void *memory = mmap(nullptr, page, PROT_READ, MAP_SHARED, counter_fds[i], 0);
+        if (memory == MAP_FAILED) {
+            user_read = false;
+            continue;
+        }
+        counter_pages[i] = static_cast<perf_event_mmap_page *>(memory);
+        uint64_t value;
+        if (!read_user_counter(counter_pages[i], value)) user_read = false;
+    }
+}
+
+static bool open_counters() {
+    // perf_event_paranoid >= 2 refuses kernel counting to unprivileged users: retry user space only
+    for (bool exclude_kernel : { false, true }) {
+        counter_fds[0] = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1, exclude_kernel);
+        if (counter_fds[0] == -1) continue;
+
+        counter_fds[1] = open_counter(PERF_COUNT_HW_INSTRUCTIONS, counter_fds[0], exclude_kernel);
+        if (counter_fds[1] == -1) {
+            close_counters();
+            continue;
+        }
+        counter_fds[2] = open_counter(PERF_COUNT_HW_CACHE_MISSES, counter_fds[0], exclude_kernel); // Optional
+        counter_count = counter_fds[2] == -1 ? 2 : 3;
+
+        ioctl(counter_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        map_counters();
+        return true;
+    }
+    return false;
+}
+
+static void read_counters(uint64_t counters[3]) {
+    counters[0] = counters[1] = counters[2] = 0;
+    if (counter_count == 0) return;
+
+    if (user_read) {
+        size_t i = 0;
+        while (i < counter_count && read_user_counter(counter_pages[i], counters[i])) i++;
+        if (i == counter_count) return;
+        // Descheduled in between: the syscall below gives a consistent group
+    }
+
+    uint64_t values[1 + 3] = { 0 }; // nr, then the counters
+    if (read(counter_fds[0], values, sizeof(values)) <= 0) return;
+    for (size_t i = 0; i < counter_count && i < values[0]; i++) counters[i] = values[1 + i];
+}
+
+static stage_stats_t per_call(const stage_stats_t &total, uint64_t calls) {
+    return { 1, total.ns / calls, total.cycles / calls, total.instructions / calls, total.cache_misses / calls };
+}
+
+static stage_stats_t cheapest(const stage_stats_t &a, const stage_stats_t &b) {
+    return { 1, std::min(a.ns, b.ns), std::min(a.cycles, b.cycles), std::min(a.instructions, b.instructions), std::min(a.cache_misses, b.cache_misses) };
+}
+
+static uint64_t subtract(uint64_t value, uint64_t cost) {
+    return value > cost ? value - cost : 0;
+}
+
+// Cost of the probes themselves: empty ones, then empty ones inside another (several rounds, cheapest kept)
+static void calibrate() {
+    own_cost = nested_cost = { 0, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+    for (int round = 0; round < 5; round++) {
+        stage_stats = {};
+        stage_nested = {};
+        for (int i = 0; i < STAGE_PROFILER_CALIBRATION; i++) {
+            StageProbe empty(STAGE_CRC);
+        }
+        for (int i = 0; i < STAGE_PROFILER_CALIBRATION; i++) {
+            StageProbe outer(STAGE_DECODE);
+            StageProbe inner(STAGE_CRC);
+        }
+        stage_stats_t single = per_call(stage_stats[STAGE_CRC], 2 * STAGE_PROFILER_CALIBRATION); // Both loops, same probe
+        stage_stats_t outer = per_call(stage_stats[STAGE_DECODE], STAGE_PROFILER_CALIBRATION);
+        own_cost = cheapest(own_cost, single);
+        nested_cost = cheapest(nested_cost, { 1, subtract(outer.ns, single.ns), subtract(outer.cycles, single.cycles),
+                                              subtract(outer.instructions, single.instructions), subtract(outer.cache_misses, single.cache_misses) });
+    }
+    stage_stats = {};
+    stage_nested = {};
+}
+
+bool enable_stage_profiler(bool print_on_exit) {
+    if (counter_count == 0) open_counters();
+    if (print_on_exit && !exit_hook) exit_hook = std::atexit(print_stage_stats) == 0;
+
+    stage_profiler_active = true;
+    calibrate();
+
+    const char *mode = counter_count == 0 ? "TIME ONLY (perf_event_open NOT AVAILABLE)" : user_read ? "HARDWARE COUNTERS (RDPMC)" : "HARDWARE COUNTERS (READ SYSCALL)";
+    std::cout << "[PROFILER] ENABLED, " << mode << ", PROBE COST " << own_cost.ns << " ns / " << nested_cost.ns << " ns NESTED (SUBTRACTED)" << std::endl;
+    return counter_count != 0;
+}
+
+void disable_stage_profiler() {
+    stage_profiler_active = false;
+    close_counters();
+}
+
+void reset_stage_profiler() {
+    stage_stats = {};
+    stage_nested = {};
+}
+
+std::array<stage_stats_t, STAGE_COUNT> get_stage_stats() {
+    std::array<stage_stats_t, STAGE_COUNT> corrected;
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        const stage_stats_t &s = stage_stats[i];
+        uint64_t calls = s.calls, nested = stage_nested[i];
+        corrected[i].calls = calls;
+        corrected[i].ns = subtract(s.ns, calls * own_cost.ns + nested * nested_cost.ns);
+        corrected[i].cycles = subtract(s.cycles, calls * own_cost.cycles + nested * nested_cost.cycles);
+        corrected[i].instructions = subtract(s.instructions, calls * own_cost.instructions + nested * nested_cost.instructions);
+        corrected[i].cache_misses = subtract(s.cache_misses, calls * own_cost.cache_misses + nested * nested_cost.cache_misses);
+    }
+    return corrected;
+}
+
+void print_stage_stats() {
+    std::array<stage_stats_t, STAGE_COUNT> stats = get_stage_stats();
+
+    std::cout << "[PROFILER] STAGE       CALLS    TOTAL us    ns/call  cycles/call   instr/call    IPC  misses/call" << std::endl;
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        const stage_stats_t &s = stats[i];
+        double calls = s.calls > 0 ? s.calls : 1;
+        std::cout << "[PROFILER] " << std::left << std::setw(8) << stage_names[i] << std::right
+                  << std::setw(11) << s.calls
+                  << std::setw(12) << std::fixed << std::setprecision(1) << s.ns / 1000.0
+                  << std::setw(11) << s.ns / calls
+                  << std::setw(13) << s.cycles / calls
+                  << std::setw(13) << s.instructions / calls
+                  << std::setw(7) << std::setprecision(2) << (s.cycles > 0 ? static_cast<double>(s.instructions) / s.cycles : 0.0)
+                  << std::setw(13) << std::setprecision(1) << s.cache_misses / calls << std::endl;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+void StageProbe::start(PROFILER_STAGE stage) {
+    m_stage = stage;
+    m_parent = current_probe;
+    m_nested = 0;
+    current_probe = this;
+    read_counters(m_start_counters);
+    m_start_ns = now_ns();
+}
+
+void StageProbe::stop() {
+    uint64_t end_ns = now_ns();
+    uint64_t end_counters[3];
+    read_counters(end_counters);
+
+    stage_stats_t &s = stage_stats[m_stage];
+    s.calls++;
+    s.ns += end_ns - m_start_ns;
+    s.cycles += end_counters[0] - m_start_counters[0];
+    s.instructions += end_counters[1] - m_start_counters[1];
+    s.cache_misses += end_counters[2] - m_start_counters[2];
+    stage_nested[m_stage] += m_nested;
+
+    current_probe = m_parent;
+    if (m_parent != nullptr) m_parent->m_nested += 1 + m_nested;
+}
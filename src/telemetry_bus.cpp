@@ -0,0 +1,274 @@
+#include "telemetry_bus.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Utils -> Private
+
+static std::string shm_name(const std::string &name) {
+    return (!name.empty() && name[0] == '/') ? name : "/" + name;
+}
+
+static size_t segment_size(uint32_t capacity) {
+    return sizeof(telemetry_header_t) + (static_cast<size_t>(capacity) + TELEMETRY_NUM_KEYS) * sizeof(telemetry_slot_t);
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static void write_slot(telemetry_slot_t &slot, uint32_t sequence, const telemetry_frame_t &frame, size_t length) {
+    uint32_t lock = slot.lock.load(std::memory_order_relaxed);
+    slot.lock.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.sequence = sequence;
+    std::memcpy(&slot.frame, &frame, offsetof(telemetry_frame_t, payload) + length);
+
+    slot.lock.store(lock + 2, std::memory_order_release);
+}
+
+// sequence: the one of the copied frame, 0 if the slot is empty
+// False: the slot stayed locked (publisher died while writing it)
+static bool read_slot(const telemetry_slot_t &slot, telemetry_frame_t &frame, uint32_t &sequence) {
+    for (uint32_t spins = 0; spins < TELEMETRY_READ_SPINS; spins++) {
+        uint32_t before = slot.lock.load(std::memory_order_acquire);
+        if (before & 1) continue; // Publisher inside
+
+        sequence = slot.sequence;
+        if (sequence != 0) {
+            std::memcpy(&frame, &slot.frame, offsetof(telemetry_frame_t, payload));
+            size_t length = frame.length <= TELEMETRY_MAX_PAYLOAD ? frame.length : TELEMETRY_MAX_PAYLOAD;
+            std::memcpy(frame.payload, slot.frame.payload, length);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.lock.load(std::memory_order_relaxed) == before) return true;
+    }
+    return false;
+}
+
+// Publisher
+
+TelemetryPublisher::TelemetryPublisher() {
+    m_memory = nullptr;
+    m_size = 0;
+    m_header = nullptr;
+    m_ring = nullptr;
+    m_latest = nullptr;
+}
+
+bool TelemetryPublisher::open(const std::string &name, uint32_t capacity) {
+    close();
+
+    // Power of two, so that sequence % capacity survives the wrap of the 32 bit counter
+    uint32_t rounded = 1;
+    while (rounded < capacity && rounded < (1u << 31)) rounded <<= 1;
+
+    std::string path = shm_name(name);
+    size_t size = segment_size(rounded);
+
+    // Old readers keep their mapping of the unlinked segment until is_stale() tells them to reopen
+    shm_unlink(path.c_str());
+    int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+        std::cerr << "[TELEMETRY] Cannot create " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        std::cerr << "[TELEMETRY] Cannot size " << path << ": " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        shm_unlink(path.c_str());
+        return false;
+    }
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        std::cerr << "[TELEMETRY] Cannot map " << path << ": " << std::strerror(errno) << std::endl;
+        shm_unlink(path.c_str());
+        return false;
+    }
+
+    // ftruncate gives zeroed pages: every slot is empty and unlocked
+    m_name = path;
+    m_memory = memory;
+    m_size = size;
+    m_header = static_cast<telemetry_header_t *>(memory);
+    m_ring = reinterpret_cast<telemetry_slot_t *>(static_cast<uint8_t *>(memory) + sizeof(telemetry_header_t));
+    m_latest = m_ring + rounded;
+
+    m_header->version = TELEMETRY_LAYOUT_VERSION;
+    m_header->capacity = rounded;
+    m_header->write_sequence.store(0, std::memory_order_relaxed);
+    m_header->generation = monotonic_ns();
+    m_header->publisher_pid = getpid();
+    m_header->closed.store(0, std::memory_order_relaxed);
+    m_header->magic.store(TELEMETRY_MAGIC, std::memory_order_release);
+
+    std::cout << "[TELEMETRY] Publishing on " << path << " (" << rounded << " frames)" << std::endl;
+    return true;
+}
+
+void TelemetryPublisher::close() {
+    if (m_memory == nullptr) return;
+    m_header->closed.store(1, std::memory_order_release);
+    munmap(m_memory, m_size);
+    shm_unlink(m_name.c_str());
+    m_memory = nullptr;
+    m_header = nullptr;
+    m_ring = nullptr;
+    m_latest = nullptr;
+}
+
+void TelemetryPublisher::publish(uint8_t key, uint8_t address, const uint8_t *payload, size_t length) {
+    if (m_header == nullptr) return;
+    if (length > TELEMETRY_MAX_PAYLOAD) length = TELEMETRY_MAX_PAYLOAD;
+
+    telemetry_frame_t frame;
+    frame.key = key;
+    frame.address = address;
+    frame.length = static_cast<uint16_t>(length);
+    frame.timestamp_ns = monotonic_ns();
+    std::memcpy(frame.payload, payload, length);
+
+    uint32_t sequence = m_header->write_sequence.load(std::memory_order_relaxed);
+
+    write_slot(m_ring[sequence & (m_header->capacity - 1)], sequence + 1, frame, length);
+    write_slot(m_latest[key], sequence + 1, frame, length);
+
+    m_header->write_sequence.store(sequence + 1, std::memory_order_release);
+}
+
+TelemetryPublisher::~TelemetryPublisher() {
+    close();
+}
+
+// Reader
+
+TelemetryReader::TelemetryReader() {
+    m_memory = nullptr;
+    m_size = 0;
+    m_header = nullptr;
+    m_ring = nullptr;
+    m_latest = nullptr;
+    m_next = 0;
+    m_lost = 0;
+    m_generation = 0;
+}
+
+bool TelemetryReader::open(const std::string &name) {
+    close();
+
+    std::string path = shm_name(name);
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(telemetry_header_t)) {
+        ::close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) return false;
+
+    const telemetry_header_t *header = static_cast<const telemetry_header_t *>(memory);
+
+    if (header->magic.load(std::memory_order_acquire) != TELEMETRY_MAGIC
+        || header->version != TELEMETRY_LAYOUT_VERSION
+        || segment_size(header->capacity) > size) {
+        std::cerr << "[TELEMETRY] Incompatible segment " << path << std::endl;
+        munmap(memory, size);
+        return false;
+    }
+
+    m_memory = memory;
+    m_size = size;
+    m_header = header;
+    m_ring = reinterpret_cast<const telemetry_slot_t *>(static_cast<const uint8_t *>(memory) + sizeof(telemetry_header_t));
+    m_latest = m_ring + header->capacity;
+    m_next = header->write_sequence.load(std::memory_order_acquire);
+    m_lost = 0;
+    m_name = path;
+    m_generation = header->generation;
+    return true;
+}
+
+void TelemetryReader::close() {
+    if (m_memory == nullptr) return;
+    munmap(const_cast<void *>(m_memory), m_size);
+    m_memory = nullptr;
+    m_header = nullptr;
+    m_ring = nullptr;
+    m_latest = nullptr;
+}
+
+bool TelemetryReader::read_next(telemetry_frame_t &frame) {
+    if (m_header == nullptr) return false;
+    uint32_t capacity = m_header->capacity;
+
+    while (true) {
+        uint32_t written = m_header->write_sequence.load(std::memory_order_acquire);
+        uint32_t available = written - m_next;
+        if (available == 0) return false;
+
+        // Lapped by the publisher: jump to the oldest frame still in the ring
+        if (available > capacity) {
+            m_lost += available - capacity;
+            m_next = written - capacity;
+        }
+
+        uint32_t sequence;
+        if (!read_slot(m_ring[m_next & (capacity - 1)], frame, sequence)) return false;
+        if (sequence == m_next + 1) {
+            m_next++;
+            return true;
+        }
+        // Slot overwritten while we were reading it, retry from the new position
+    }
+}
+
+bool TelemetryReader::read_latest(uint8_t key, telemetry_frame_t &frame) const {
+    if (m_header == nullptr) return false;
+    uint32_t sequence;
+    return read_slot(m_latest[key], frame, sequence) && sequence != 0;
+}
+
+bool TelemetryReader::is_stale() const {
+    if (m_header == nullptr) return true;
+    if (m_header->closed.load(std::memory_order_acquire)) return true;
+    if (kill(m_header->publisher_pid, 0) == -1 && errno == ESRCH) return true;
+
+    // Segment under the name replaced (or removed) by another publisher
+    int fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+    if (fd == -1) return true;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(telemetry_header_t)) {
+        ::close(fd);
+        return true; // Being created: not sized yet
+    }
+    void *memory = mmap(nullptr, sizeof(telemetry_header_t), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) return true;
+    const telemetry_header_t *current = static_cast<const telemetry_header_t *>(memory);
+    bool replaced = current->magic.load(std::memory_order_acquire) != TELEMETRY_MAGIC || current->generation != m_generation;
+    munmap(memory, sizeof(telemetry_header_t));
+    return replaced;
+}
+
+TelemetryReader::~TelemetryReader() {
+    close();
+}
@@ -1,10 +1,18 @@
-#!bin/bash
+#!/bin/bash
 
+# Built-in per-stage profiler at full speed (default)
+# ./start_profiling.sh callgrind -> previous valgrind run (about 50x slower, serial timing distorted)
 
 cd build
-rm report.callgrind
-cmake .. && make && valgrind --tool=callgrind --dump-instr=yes --collect-bus=yes --callgrind-out-file=report.callgrind ./myapp profile 
-kcachegrind report.callgrind
+cmake .. && make || exit 1
 
+if [ "$1" == "callgrind" ]; then
+    rm -f report.callgrind
+    valgrind --tool=callgrind --dump-instr=yes --collect-bus=yes --callgrind-out-file=report.callgrind ./myapp profile
+    kcachegrind report.callgrind
+else
+    ./myapp profile
+fi
 
-exit 0
\ No newline at end of file
+
+exit 0
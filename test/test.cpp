@@ -1,5 +1,10 @@
 // This main.cpp is for demonstration purposes only
 #include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include "nucleo_protocol.hpp"
 
 #define ADDRESS 0x00
@@ -7,14 +12,208 @@
 #define SUB_VERSION 0x01
 #define INTERVAL_KEY 0x00
 #define BAUDRATE 115200
+#define ALLOC_WARM_UP 50 // Iterations before the allocation budget is enforced
+#define JITTER_PERIOD_US 1000
+#define JITTER_SAMPLES 5000
+#define AGGBENCH_SAMPLES 100000
+#define BUS_TEST_NAME "chimpanzee_busreaders"
+#define BUS_TEST_FRAMES 999  // Per phase, fits the ring: no frame may be lost
+#define BUS_TEST_KEYS 3
+#define BUS_TEST_BATCH 9     // Frames per write on the pty, 3 of each key
+#define BUS_TEST_READERS 3
+#define BUS_TEST_TIMEOUT 5   // s
 
 
-void print_vec_(std::vector<uint8_t> val) {
+// Allocation counter (used by "alloc" mode): every global operator new passes from here
+static std::atomic<size_t> allocation_count{0};
+
+void *operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = static_cast<size_t>(align);
+    if (void *ptr = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)) return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+void *operator new[](std::size_t size, std::align_val_t align) { return operator new(size, align); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+
+void print_vec_(const std::pmr::vector<uint8_t> &val) {
     for (int i = 0; i < val.size(); i++) std::cout << std::hex << static_cast<int>(val[i]) << " ";
     std::cout << std::dec << std::endl;
 }
 
 
+// Bytes on the wire of a Nucleo frame (example.ino escapes 0xEE and 0x7E, start byte excluded, END_SEQ added)
+size_t stuffed_size(const std::vector<uint8_t> &body) {
+    size_t size = 2;
+    for (size_t i = 1; i < body.size(); i++) size += (body[i] == END_SEQ || body[i] == ESCAPE_CHAR) ? 2 : 1;
+    return size;
+}
+
+// Effective samples per second: one sensor frame per sample vs aggregated frames
+void aggregate_benchmark() {
+    const int baudrates[] = { 9600, 57600, 115200, 230400, 460800, 921600 };
+    const size_t batches[] = { 1, 2, 4, 8, 16 };
+    std::vector<uint16_t> values(AGGBENCH_SAMPLES);
+    for (auto &value : values) value = std::rand() % 1024;
+
+    std::cout << "BATCH\tBYTES/SAMPLE";
+    for (int baudrate : baudrates) std::cout << "\t" << baudrate;
+    std::cout << std::endl;
+
+    for (size_t batch : batches) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < values.size(); i += batch) {
+            size_t count = std::min(batch, values.size() - i);
+            std::vector<uint8_t> body;
+            // Batch of 1: the classic sensor frame AA addr 00 id type high low
+            if (batch == 1) body = { COMM_SEQ, ADDRESS, 0x00 };
+            else body = { COMM_SEQ, ADDRESS, AGGREGATE_COMMAND, static_cast<uint8_t>(count) };
+            for (size_t j = i; j < i + count; j++) {
+                body.insert(body.end(), { static_cast<uint8_t>(j % 3), 0x00, static_cast<uint8_t>(values[j] >> 8), static_cast<uint8_t>(values[j] & 0xFF) });
+            }
+            body.push_back(calculate_CRC_8(body.data(), body.size()));
+            bytes += stuffed_size(body);
+        }
+
+        double bytes_per_sample = static_cast<double>(bytes) / values.size();
+        std::cout << batch << "\t" << bytes_per_sample;
+        // 8N1: 10 bits on the wire per byte
+        for (int baudrate : baudrates) std::cout << "\t" << static_cast<int>(baudrate / 10.0 / bytes_per_sample);
+        std::cout << std::endl;
+    }
+}
+
+
+// Reader process of "busreaders": every frame in order, then the publisher restart, then every frame again
+int bus_reader(int ready_fd) {
+    TelemetryReader reader;
+    telemetry_frame_t frame;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(BUS_TEST_TIMEOUT);
+
+    for (uint8_t phase = 0; phase < 2; phase++) {
+        while (!reader.open(BUS_TEST_NAME)) {
+            if (std::chrono::steady_clock::now() > deadline) return 1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (write(ready_fd, "r", 1) != 1) return 1;
+
+        // Sensor payload: id type value_high value_low, keys interleaved as written on the pty
+        for (uint16_t expected = 0; expected < BUS_TEST_FRAMES;) {
+            if (!reader.read_next(frame)) {
+                if (std::chrono::steady_clock::now() > deadline) return 1;
+                std::this_thread::yield();
+                continue;
+            }
+            uint8_t key = 1 + expected % BUS_TEST_KEYS;
+            uint16_t value = (static_cast<uint16_t>(frame.payload[2]) << 8) | frame.payload[3];
+            if (frame.key != key || frame.length != AGGREGATE_TUPLE_SIZE || frame.payload[0] != key || value != expected) return 1;
+            expected++;
+        }
+        if (reader.get_lost() != 0) return 1;
+
+        // The publisher restarts after its last frame: the old mapping must be reported stale
+        while (phase == 0 && !reader.is_stale()) {
+            if (std::chrono::steady_clock::now() > deadline) return 1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        reader.close();
+    }
+    return 0;
+}
+
+// Nucleo side of "busreaders": one write() of BUS_TEST_BATCH stuffed sensor frames, keys 1..BUS_TEST_KEYS in turn
+bool write_sensor_batch(int fd, uint16_t first) {
+    std::pmr::vector<uint8_t> bytes;
+    for (uint16_t value = first; value < first + BUS_TEST_BATCH; value++) {
+        uint8_t key = 1 + value % BUS_TEST_KEYS;
+        std::pmr::vector<uint8_t> frame({ COMM_SEQ, ADDRESS, 0x00, key, 0x00, static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value & 0xFF) });
+        frame.push_back(calculate_CRC_8(frame));
+        add_escape_char(frame);
+        frame.push_back(END_SEQ);
+        bytes.insert(bytes.end(), frame.begin(), frame.end());
+    }
+    return write(fd, bytes.data(), bytes.size()) == static_cast<ssize_t>(bytes.size());
+}
+
+// Several reader processes against a Protocol fed through a pty, across a publisher restart
+bool bus_readers_test(int readers) {
+    int ready[2];
+    if (pipe(ready) == -1) return false;
+
+    // The master end plays the Nucleo, the Protocol opens the slave like a UART
+    int nucleo = posix_openpt(O_RDWR | O_NOCTTY);
+    if (nucleo == -1 || grantpt(nucleo) == -1 || unlockpt(nucleo) == -1) return false;
+
+    Protocol p(VERSION, SUB_VERSION, ADDRESS, BAUDRATE);
+    if (!p.set_serial_device(ptsname(nucleo)) || !p.enable_telemetry_bus(BUS_TEST_NAME, BUS_TEST_FRAMES)) return false;
+
+    std::vector<pid_t> children;
+    for (int i = 0; i < readers; i++) {
+        pid_t pid = fork();
+        if (pid == 0) _exit(bus_reader(ready[1]));
+        if (pid > 0) children.push_back(pid);
+    }
+    close(ready[1]); // Readers gone -> read() returns 0 instead of blocking
+
+    char byte;
+    keys_t keys;
+    for (uint8_t key = 1; key <= BUS_TEST_KEYS; key++) keys.push_back(key);
+
+    bool attached = children.size() == readers;
+    for (uint8_t phase = 0; phase < 2 && attached; phase++) {
+        if (phase == 1) p.enable_telemetry_bus(BUS_TEST_NAME, BUS_TEST_FRAMES); // Restart: new segment, new generation
+
+        // Every reader attached: reading starts from the next published frame
+        for (size_t i = 0; i < children.size() && attached; i++) attached = read(ready[0], &byte, 1) == 1;
+        if (!attached) break;
+
+        // Several frames of a key per read: only the newest stays in the buffer, every one must reach the bus
+        for (uint16_t first = 0; first < BUS_TEST_FRAMES; first += BUS_TEST_BATCH) {
+            if (!write_sensor_batch(nucleo, first)) break;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            for (size_t seen = 0; seen < keys.size() && std::chrono::steady_clock::now() < deadline;) {
+                p.wait_for(keys, deadline);
+                for (uint8_t key : keys) {
+                    packet_t sensor = p.get_sensor(key);
+                    if (sensor.first != COMM_STATUS::OK) continue;
+                    uint16_t value = (static_cast<uint16_t>((*sensor.second)[2]) << 8) | (*sensor.second)[3];
+                    if (value >= first + BUS_TEST_BATCH - BUS_TEST_KEYS) seen++; // Last frame of the key in the batch
+                }
+            }
+        }
+    }
+
+    int failed = readers - children.size();
+    for (pid_t pid : children) {
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    p.disable_telemetry_bus();
+    close(nucleo);
+    close(ready[0]);
+
+    if (failed != 0) std::cerr << "BUS FAILED: " << failed << " of " << readers << " readers" << std::endl;
+    else std::cout << "BUS SUCCESS: " << readers << " readers, " << 2 * BUS_TEST_FRAMES << " frames each from the pty, in order, across a publisher restart" << std::endl;
+    return failed == 0;
+}
+
+
 // Function which handles disconnection
 void handle_disconnection(Protocol &p) {
     if (!p.is_connected()) {
@@ -31,17 +230,51 @@ void handle_disconnection(Protocol &p) {
 
 int main(int argc, char **argv) {
     // Init variables
+    bool alloc_mode = argc > 1 && std::strcmp(argv[1], "alloc") == 0;
+    bool profile_mode = argc > 1 && std::strcmp(argv[1], "profile") == 0;
+
+    // Per-stage summary at exit (same as CHIMPANZEE_PROFILE=1 in any mode)
+    if (profile_mode) enable_stage_profiler();
 
     protocol_config_t chimpanzee_config {
         .address = ADDRESS,
         .version = VERSION,
         .sub_version = SUB_VERSION,
         .baudrate = BAUDRATE,
-        .verbose = true,
+        .verbose = !alloc_mode && !profile_mode,
     };
 
-    Protocol p(VERSION, SUB_VERSION, ADDRESS, BAUDRATE, true); // -> Is going to be deprecated
-    // Protocol p(chimpanzee_config);
+    // Wake-up jitter with and without the real-time profile: ./myapp jitter [cpu] [priority]
+    if (argc > 1 && std::strcmp(argv[1], "jitter") == 0) {
+        realtime_config_t rt_config;
+        rt_config.cpu = argc > 2 ? std::atoi(argv[2]) : 0;
+        rt_config.fifo = true;
+        rt_config.priority = argc > 3 ? std::atoi(argv[3]) : RT_DEFAULT_PRIORITY;
+        rt_config.lock_memory = true;
+
+        print_latency_stats("DEFAULT", measure_wakeup_latency(std::chrono::microseconds(JITTER_PERIOD_US), JITTER_SAMPLES));
+        apply_realtime_profile(rt_config);
+        print_latency_stats("REALTIME", measure_wakeup_latency(std::chrono::microseconds(JITTER_PERIOD_US), JITTER_SAMPLES));
+        return 0;
+    }
+
+    // Effective samples per second per baud rate, with and without aggregated frames
+    if (argc > 1 && std::strcmp(argv[1], "aggbench") == 0) {
+        aggregate_benchmark();
+        return 0;
+    }
+
+    // Multi-process telemetry bus check: ./myapp busreaders [readers]
+    if (argc > 1 && std::strcmp(argv[1], "busreaders") == 0) {
+        return bus_readers_test(argc > 2 ? std::atoi(argv[2]) : BUS_TEST_READERS) ? 0 : 1;
+    }
+
+    // Allocation budget: after warm-up the pool recycles its blocks, the heap is not touched anymore
+    std::pmr::unsynchronized_pool_resource pool;
+    std::pmr::memory_resource *resource = alloc_mode ? &pool : std::pmr::get_default_resource();
+
+    Protocol p(VERSION, SUB_VERSION, ADDRESS, BAUDRATE, chimpanzee_config.verbose, resource); // -> Is going to be deprecated
+    // Protocol p(chimpanzee_config, resource);
 
     uint16_t p_motor[8] = { 0xEEEE, 0x2230, 0xffff, 0xaabb, 0xdead, 0xbeef, 0xaabb, 0x7E7E };
     uint16_t p_arm[1] = { 0xEEEE };
@@ -71,6 +304,10 @@ int main(int argc, char **argv) {
     }
     std::cout << "INIT SUCCESS" << std::endl;
 
+    // CLOCK SYNC (timestamped frames -> sample time in host clock)
+    if (p.sync_clock() != COMM_STATUS::OK) std::cout << "CLOCK SYNC FAILED" << std::endl;
+    p.set_clock_sync_interval(std::chrono::seconds(1));
+
 
     // SET POLLING SESSION
     p.set_sensor(temperature);
@@ -79,12 +316,17 @@ int main(int argc, char **argv) {
     // COMMUNICATION
     keys_t keys;
     COMM_STATUS status;
+    keys_t inputs = { HB_SEQ, temperature.id, flood.id };
 
 
     int i = 0;
     while (true) {
+        size_t allocations_before = allocation_count.load(std::memory_order_relaxed);
+
         handle_disconnection(p);
-        p.update_buffer();
+
+        // Run as soon as every input is fresh (at most every 100 ms)
+        p.wait_for(inputs, std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
 
         // Send motor data 
         p.send_packet(COMM_TYPE::MOTOR, p_motor, 8);
@@ -97,21 +339,39 @@ int main(int argc, char **argv) {
         packet_t sensor_2 = p.get_sensor(flood.id);
         
         
-        std::cout << "[HB]" << std::endl;
-        if (hb.first == COMM_STATUS::OK) print_vec_(hb.second.value());
-        else std::cout << "PROTOCOL ERROR CODE 0x" << hb.first << std::endl;
+        if (alloc_mode) {
+            // Packets still alive: only their deallocation is left, and it is not counted
+            size_t allocations = allocation_count.load(std::memory_order_relaxed) - allocations_before;
+            if (i >= ALLOC_WARM_UP && allocations != 0) {
+                std::cerr << "ALLOC FAILED: " << allocations << " heap allocations at iteration " << i << std::endl;
+                return 1;
+            }
+            if (i == 2 * ALLOC_WARM_UP) {
+                std::cout << "ALLOC SUCCESS: no heap allocations in " << ALLOC_WARM_UP << " iterations after warm-up" << std::endl;
+                break;
+            }
+        }
+        else {
+            std::cout << "[HB]" << std::endl;
+            if (hb.first == COMM_STATUS::OK) print_vec_(hb.second.value());
+            else std::cout << "PROTOCOL ERROR CODE 0x" << hb.first << std::endl;
 
-        std::cout << "[SENSOR_1]" << std::endl;
-        if (sensor_1.first == COMM_STATUS::OK) print_vec_(sensor_1.second.value());
-        else std::cout << "PROTOCOL ERROR CODE 0x" << sensor_1.first << std::endl;
-        
-        std::cout << "[SENSOR_2]" << std::endl;
-        if (sensor_2.first == COMM_STATUS::OK) print_vec_(sensor_2.second.value());
-        else std::cout << "PROTOCOL ERROR CODE 0x" << sensor_2.first << std::endl;
-        
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            std::cout << "[SENSOR_1]" << std::endl;
+            if (sensor_1.first == COMM_STATUS::OK) print_vec_(sensor_1.second.value());
+            else std::cout << "PROTOCOL ERROR CODE 0x" << sensor_1.first << std::endl;
+
+            frame_timing_t timing = p.get_timing(temperature.id);
+            if (sensor_1.first == COMM_STATUS::OK && timing.sample_time) {
+                std::cout << "SAMPLE -> ARRIVAL " << std::chrono::duration_cast<std::chrono::microseconds>(timing.arrival_time - *timing.sample_time).count()
+                          << " us, SAMPLE -> CONSUME " << std::chrono::duration_cast<std::chrono::microseconds>(timing.consume_time - *timing.sample_time).count() << " us" << std::endl;
+            }
+            
+            std::cout << "[SENSOR_2]" << std::endl;
+            if (sensor_2.first == COMM_STATUS::OK) print_vec_(sensor_2.second.value());
+            else std::cout << "PROTOCOL ERROR CODE 0x" << sensor_2.first << std::endl;
+        }
         
-        if (argc > 1 && std::strcmp(argv[1], "profile") == 0) {
+        if (profile_mode) {
             if (i % 200 == 0) std::cout << "PROFILE [" << i << "/5] TO END" << std::endl;
             if (i == 1000) break;
         }